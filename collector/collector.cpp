@@ -0,0 +1,384 @@
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "stream.h"
+
+/*
+ * The receiving end of `sender host port':  one thread and one epoll
+ * set take any number of senders on one port.  Each connection is
+ * written to its own trace file, <dir>/<host>.<n>.bin, and with -s also
+ * split as it arrives into <dir>/<host>.<n>/, as `splitter' would.  The
+ * throughput and loss of every host are reported every so often and on
+ * the way out.
+ */
+
+#define READ_SIZE (256 * 1024)
+
+/* Reads per connection per wakeup, so one busy sender can't starve the rest */
+#define READ_BURST (4)
+
+#define MAX_EVENTS (64)
+
+struct connection {
+	int fd;
+	int listener;
+	std::string host;
+	struct stream *stream;
+};
+
+struct host_entry {
+	unsigned connections;	/* Ever */
+	unsigned open;
+	struct stream_stats closed;	/* Summed over closed connections */
+	uint64_t reported_bytes;	/* At the last report, for the rate */
+};
+
+static struct {
+	const char *service;
+	const char *dir;
+	unsigned interval_s;
+	int split;		/* -s:  0 off, 't' or 'b' for the splitter's formats */
+
+	int epoll;
+	std::vector<struct connection *> listeners;
+	std::vector<struct connection *> open;
+	std::map<std::string, struct host_entry> hosts;
+
+	long last_report;	/* ms */
+} co;
+
+static volatile sig_atomic_t stopping = 0;
+
+static char buf[READ_SIZE];
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void on_signal(int sig)
+{
+	(void)(sig);
+	stopping = 1;
+}
+
+static int watch(struct connection *c)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	return epoll_ctl(co.epoll, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static int listen_all()
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs = NULL;
+	struct addrinfo *a = NULL;
+	int rc = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	rc = getaddrinfo(NULL, co.service, &hints, &addrs);
+	if (rc) {
+		fprintf(stderr, "Error looking up port %s:  %s\n", co.service, gai_strerror(rc));
+		return -1;
+	}
+
+	for (a = addrs; a; a = a->ai_next) {
+		struct connection *c = NULL;
+		int one = 1;
+		int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK, a->ai_protocol);
+
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		/* Keep IPv6 to itself so the IPv4 socket can bind too */
+		if (a->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+		if (bind(fd, a->ai_addr, a->ai_addrlen) || listen(fd, 128)) {
+			fprintf(stderr, "Error listening on port %s (%s):  %s\n", co.service,
+			    a->ai_family == AF_INET6 ? "IPv6" : "IPv4", strerror(errno));
+			close(fd);
+			continue;
+		}
+		c = new connection();
+		c->fd = fd;
+		c->listener = 1;
+		c->stream = NULL;
+		if (watch(c)) {
+			fprintf(stderr, "Error adding a listener to epoll:  %s\n", strerror(errno));
+			close(fd);
+			delete c;
+			continue;
+		}
+		co.listeners.push_back(c);
+	}
+	freeaddrinfo(addrs);
+	return co.listeners.empty() ? -1 : 0;
+}
+
+/* Create <dir>/<host>.<n>.bin, taking the next n that isn't there yet */
+static struct stream *open_trace(const std::string &host, struct host_entry &h)
+{
+	char path[4096];
+	struct stream *s = NULL;
+
+	do {
+		snprintf(path, sizeof(path), "%s/%s.%u.bin", co.dir, host.c_str(), h.connections++);
+		s = stream_open(path);
+	} while (!s && errno == EEXIST);
+	if (!s) {
+		fprintf(stderr, "Error creating %s:  %s\n", path, strerror(errno));
+		return NULL;
+	}
+	fprintf(stderr, "%s connected, writing %s\n", host.c_str(), path);
+
+	/* The split directory goes next to it, without the .bin */
+	path[strlen(path) - 4] = '\0';
+	if (co.split && stream_split(s, path, co.split == 't')) {
+		fprintf(stderr, "Error creating %s:  %s\n", path, strerror(errno));
+		stream_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+static void accept_all(struct connection *l)
+{
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		char host[NI_MAXHOST];
+		struct connection *c = NULL;
+		int fd = accept4(l->fd, (struct sockaddr *)(&addr), &len, SOCK_NONBLOCK);
+
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				fprintf(stderr, "Error accepting:  %s\n", strerror(errno));
+			return;
+		}
+		if (getnameinfo((struct sockaddr *)(&addr), len, host, sizeof(host),
+		    NULL, 0, NI_NUMERICHOST))
+			strcpy(host, "unknown");
+
+		c = new connection();
+		c->fd = fd;
+		c->listener = 0;
+		c->host = host;
+		c->stream = open_trace(c->host, co.hosts[c->host]);
+		if (!c->stream || watch(c)) {
+			if (c->stream)
+				stream_close(c->stream);
+			close(fd);
+			delete c;
+			continue;
+		}
+		++co.hosts[c->host].open;
+		co.open.push_back(c);
+	}
+}
+
+static void add_stats(struct stream_stats *into, const struct stream_stats *st)
+{
+	into->bytes += st->bytes;
+	into->packets += st->packets;
+	into->samples += st->samples;
+	into->missed += st->missed;
+}
+
+static void close_connection(struct connection *c)
+{
+	struct host_entry &h = co.hosts[c->host];
+	struct stream_stats st;
+	size_t i = 0;
+
+	epoll_ctl(co.epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	stream_get_stats(c->stream, &st);
+	stream_close(c->stream);
+	add_stats(&h.closed, &st);
+	--h.open;
+	fprintf(stderr, "%s disconnected after %llu bytes, %llu samples, %llu missed\n",
+	    c->host.c_str(), (unsigned long long)(st.bytes),
+	    (unsigned long long)(st.samples), (unsigned long long)(st.missed));
+
+	for (i = 0; i < co.open.size(); ++i) {
+		if (co.open[i] == c) {
+			co.open[i] = co.open.back();
+			co.open.pop_back();
+			break;
+		}
+	}
+	delete c;
+}
+
+static void receive(struct connection *c)
+{
+	int i = 0;
+
+	for (i = 0; i < READ_BURST; ++i) {
+		ssize_t rc = read(c->fd, buf, sizeof(buf));
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (rc < 0)
+			fprintf(stderr, "Error reading from %s:  %s\n", c->host.c_str(), strerror(errno));
+		if (rc <= 0 || stream_feed(c->stream, buf, rc)) {
+			close_connection(c);
+			return;
+		}
+		if ((size_t)(rc) < sizeof(buf))
+			return;
+	}
+}
+
+static void report(int final)
+{
+	long now = now_ms();
+	double seconds = (now - co.last_report) / 1000.0;
+	struct stream_stats total;
+	std::map<std::string, struct stream_stats> current;
+	size_t i = 0;
+
+	memset(&total, 0, sizeof(total));
+	for (auto it = co.hosts.begin(); it != co.hosts.end(); ++it)
+		current[it->first] = it->second.closed;
+	for (i = 0; i < co.open.size(); ++i) {
+		struct stream_stats st;
+		stream_get_stats(co.open[i]->stream, &st);
+		add_stats(&current[co.open[i]->host], &st);
+	}
+
+	fprintf(stderr, "%s%zu hosts, %zu connections open:\n", final ? "Final:  " : "",
+	    co.hosts.size(), co.open.size());
+	for (auto it = co.hosts.begin(); it != co.hosts.end(); ++it) {
+		struct host_entry &h = it->second;
+		struct stream_stats &st = current[it->first];
+		uint64_t all = st.samples + st.missed;
+
+		fprintf(stderr, "  %-24s %3u/%-3u conns %10.1f MB %9.1f KB/s %12llu samples "
+		    "%10llu missed (%.3f%%)\n",
+		    it->first.c_str(), h.open, h.connections, st.bytes / 1e6,
+		    seconds > 0 ? (st.bytes - h.reported_bytes) / 1e3 / seconds : 0.0,
+		    (unsigned long long)(st.samples), (unsigned long long)(st.missed),
+		    all ? 100.0 * st.missed / all : 0.0);
+		h.reported_bytes = st.bytes;
+		add_stats(&total, &st);
+	}
+	fprintf(stderr, "  %-24s %10.1f MB, %llu samples, %llu missed\n", "total",
+	    total.bytes / 1e6, (unsigned long long)(total.samples),
+	    (unsigned long long)(total.missed));
+	co.last_report = now;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage:  %s [-p port] [-d dir] [-b KB] [-i seconds] [-s t|b]\n", program);
+	fprintf(stderr, "  -p  port to listen on (3141)\n");
+	fprintf(stderr, "  -d  where trace files go (.)\n");
+	fprintf(stderr, "  -b  write buffer per connection, in KB (1024)\n");
+	fprintf(stderr, "  -i  seconds between reports, 0 for only the last (10)\n");
+	fprintf(stderr, "  -s  also split each connection, to text or binary files\n");
+}
+
+int main(int argc, const char** argv) {
+	const char *program = *argv;
+	struct epoll_event events[MAX_EVENTS];
+	struct sigaction sa;
+	int i = 0;
+
+	--argc; ++argv;
+
+	co.service = "3141";
+	co.dir = ".";
+	co.interval_s = 10;
+	co.split = 0;
+	while (argc) {
+		if (!strcmp("-p", *argv) && argc > 1) {
+			co.service = argv[1];
+		} else if (!strcmp("-d", *argv) && argc > 1) {
+			co.dir = argv[1];
+		} else if (!strcmp("-b", *argv) && argc > 1 && isdigit(*argv[1]) && atoi(argv[1])) {
+			stream_set_buffer((size_t)(atoi(argv[1])) * 1024);
+		} else if (!strcmp("-i", *argv) && argc > 1 && isdigit(*argv[1])) {
+			co.interval_s = atoi(argv[1]);
+		} else if (!strcmp("-s", *argv) && argc > 1 && *argv[1] && strchr("tb", *argv[1])) {
+			co.split = *argv[1];
+		} else {
+			usage(program);
+			return 1;
+		}
+		argc -= 2; argv += 2;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	co.epoll = epoll_create1(0);
+	if (co.epoll < 0) {
+		perror("Error creating epoll set");
+		return 1;
+	}
+	if (listen_all())
+		return 1;
+	fprintf(stderr, "Listening on port %s, writing to %s\n", co.service, co.dir);
+
+	co.last_report = now_ms();
+	while (!stopping) {
+		int n = epoll_wait(co.epoll, events, MAX_EVENTS, 1000);
+
+		if (n < 0 && errno != EINTR) {
+			perror("Error waiting for connections");
+			break;
+		}
+		for (i = 0; i < n; ++i) {
+			struct connection *c = (struct connection *)(events[i].data.ptr);
+			if (c->listener)
+				accept_all(c);
+			else
+				receive(c);
+		}
+		if (co.interval_s && now_ms() - co.last_report >= co.interval_s * 1000L)
+			report(0);
+	}
+
+	/* Whatever is still connected gets flushed and closed */
+	while (!co.open.empty())
+		close_connection(co.open.back());
+	report(1);
+
+	for (i = 0; i < (int)(co.listeners.size()); ++i) {
+		close(co.listeners[i]->fd);
+		delete co.listeners[i];
+	}
+	close(co.epoll);
+	return 0;
+}
@@ -0,0 +1,286 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "packet.h"
+#include "splitter.hpp"
+#include "stream.h"
+
+/* A record that doesn't fit in this much is taken as a broken stream */
+#define PENDING_LIMIT (4 * 1024 * 1024)
+
+#define MAX_CORES (256)
+
+struct stream {
+	int fd;
+	char *path;
+
+	/* Trace file buffer */
+	char *out;
+	size_t out_len;
+
+	/* Bytes of a record that hasn't all arrived yet */
+	char *pending;
+	size_t pending_len;
+	size_t pending_cap;
+
+	struct packet_stream *decoder;
+	Splitter *splitter;	/* Live splitting, or NULL */
+	int described;		/* Past the experiment info */
+	int broken;		/* Undecodable; still written out */
+
+	struct stream_stats stats;
+	uint32_t core_missed[MAX_CORES];
+	uint32_t interval_missed;	/* Aggregate streams */
+};
+
+static size_t buffer_size = 1024 * 1024;
+
+static struct sample samples[PACKET_MAX_SAMPLES];
+
+void stream_set_buffer(size_t bytes)
+{
+	buffer_size = bytes;
+}
+
+struct stream *stream_open(const char *path)
+{
+	struct stream *s = (struct stream *)(calloc(1, sizeof(struct stream)));
+
+	if (!s)
+		return NULL;
+	s->fd = -1;
+	s->out = (char *)(malloc(buffer_size));
+	s->path = strdup(path);
+	s->decoder = packet_stream_new();
+	if (!s->out || !s->path) {
+		stream_close(s);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (s->fd < 0) {
+		int saved = errno;
+		stream_close(s);
+		errno = saved;
+		return NULL;
+	}
+	return s;
+}
+
+static int write_all(int fd, const char *data, size_t n)
+{
+	while (n) {
+		ssize_t rc = write(fd, data, n);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		n -= rc;
+	}
+	return 0;
+}
+
+static int flush(struct stream *s)
+{
+	int rc = 0;
+
+	if (s->out_len && write_all(s->fd, s->out, s->out_len)) {
+		fprintf(stderr, "Error writing %s:  %s\n", s->path, strerror(errno));
+		rc = -1;
+	}
+	s->out_len = 0;
+	return rc;
+}
+
+static int save(struct stream *s, const char *data, size_t n)
+{
+	if (s->out_len + n > buffer_size && flush(s))
+		return -1;
+	if (n >= buffer_size) {
+		if (!write_all(s->fd, data, n))
+			return 0;
+		fprintf(stderr, "Error writing %s:  %s\n", s->path, strerror(errno));
+		return -1;
+	}
+	memcpy(s->out + s->out_len, data, n);
+	s->out_len += n;
+	return 0;
+}
+
+static void stop_splitting(struct stream *s)
+{
+	fprintf(stderr, "%s:  no longer splitting\n", s->path);
+	delete s->splitter;
+	s->splitter = NULL;
+}
+
+/* Hand the packet packet_read returned to the splitter, a process at a time */
+static void split(struct stream *s, struct packet_header &head)
+{
+	size_t at = 0;
+
+	while (at < head.quantity) {
+		struct packet_header run;
+		char *cmdline = NULL;
+		char *exe = NULL;
+
+		at += packet_run(&head, at, &run, &cmdline, &exe);
+		if (s->splitter->packet(run, cmdline, exe, samples + at - run.quantity)) {
+			stop_splitting(s);
+			return;
+		}
+	}
+}
+
+/* Decode what there is of data; returns the bytes used up */
+static size_t decode(struct stream *s, char *data, size_t n)
+{
+	struct packet_header head;
+	struct packet_interval interval;
+	const struct packet_aggregate *entries = NULL;
+	size_t at = 0;
+	size_t i = 0;
+
+	if (!s->described) {
+		char *end = (char *)(memchr(data, '\0', n));
+		if (!end)
+			return 0;
+		packet_set_format(packet_parse_format(data));
+		s->described = 1;
+		at = end - data + 1;
+		if (s->splitter && s->splitter->start(data))
+			stop_splitting(s);
+	}
+
+	while (at < n) {
+		size_t bytes = 0;
+		char *cmdline = NULL;
+		char *exe = NULL;
+		int rc = packet_read(data + at, n - at, &head, samples, &cmdline, &exe, &bytes);
+
+		if (rc == 1)
+			break;
+		if (rc < 0) {
+			fprintf(stderr, "%s:  malformed packet at byte %llu, no longer decoding\n",
+			    s->path, (unsigned long long)(s->stats.bytes - n + at));
+			s->broken = 1;
+			break;
+		}
+		if (rc == 0) {
+			++s->stats.packets;
+			s->stats.samples += head.quantity;
+			s->core_missed[head.core] = head.missed;
+			if (s->splitter)
+				split(s, head);
+		} else if (rc == 3) {
+			entries = packet_aggregates(&interval);
+			++s->stats.packets;
+			for (i = 0; i < interval.quantity; ++i)
+				s->stats.samples += entries[i].samples;
+			s->interval_missed = interval.missed;
+		}
+		at += bytes;
+	}
+	return at;
+}
+
+static void too_large(struct stream *s)
+{
+	fprintf(stderr, "%s:  record too large, no longer decoding\n", s->path);
+	s->broken = 1;
+}
+
+static int keep_pending(struct stream *s, const char *data, size_t n)
+{
+	if (s->pending_len + n > s->pending_cap) {
+		size_t cap = s->pending_cap ? s->pending_cap : 64 * 1024;
+		char *bigger = NULL;
+
+		while (cap < s->pending_len + n)
+			cap *= 2;
+		if (cap > PENDING_LIMIT)
+			return -1;
+		bigger = (char *)(realloc(s->pending, cap));
+		if (!bigger)
+			return -1;
+		s->pending = bigger;
+		s->pending_cap = cap;
+	}
+	memcpy(s->pending + s->pending_len, data, n);
+	s->pending_len += n;
+	return 0;
+}
+
+int stream_feed(struct stream *s, void *data, size_t n)
+{
+	size_t used = 0;
+
+	s->stats.bytes += n;
+	if (save(s, (const char *)(data), n))
+		return -1;
+	if (s->broken)
+		return 0;
+
+	packet_stream_select(s->decoder);
+	if (!s->pending_len) {
+		/* The usual case:  decode straight out of the socket's bytes */
+		used = decode(s, (char *)(data), n);
+		if (used < n && keep_pending(s, (char *)(data) + used, n - used))
+			too_large(s);
+	} else if (keep_pending(s, (const char *)(data), n)) {
+		too_large(s);
+	} else {
+		used = decode(s, s->pending, s->pending_len);
+		memmove(s->pending, s->pending + used, s->pending_len - used);
+		s->pending_len -= used;
+	}
+	packet_stream_select(NULL);
+	return 0;
+}
+
+int stream_split(struct stream *s, const char *dir, int text)
+{
+	if (mkdir(dir, 0777))
+		return -1;
+	s->splitter = new Splitter(dir, text ? Splitter::Text : Splitter::Binary);
+	return 0;
+}
+
+void stream_get_stats(const struct stream *s, struct stream_stats *st)
+{
+	size_t i = 0;
+
+	*st = s->stats;
+	st->missed = s->interval_missed;
+	for (i = 0; i < MAX_CORES; ++i)
+		st->missed += s->core_missed[i];
+}
+
+int stream_close(struct stream *s)
+{
+	int rc = 0;
+
+	if (s->fd >= 0) {
+		rc = flush(s);
+		if (close(s->fd)) {
+			fprintf(stderr, "Error closing %s:  %s\n", s->path, strerror(errno));
+			rc = -1;
+		}
+	}
+	delete s->splitter;	/* Finishing writes index.csv */
+	if (s->decoder)
+		packet_stream_free(s->decoder);
+	free(s->pending);
+	free(s->out);
+	free(s->path);
+	free(s);
+	return rc;
+}
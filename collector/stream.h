@@ -0,0 +1,52 @@
+
+#ifndef ANDROID_ARM_PROJECT_STREAM_H
+#define ANDROID_ARM_PROJECT_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One sender's stream as the collector receives it.  Bytes are written
+ * verbatim to a trace file (the same file `sender -o' would have made,
+ * so reader and splitter take it as is) through a large buffer, and
+ * decoded on the way past for the statistics:  packets, samples and the
+ * missed counts the sender reports.
+ *
+ * Each stream keeps its own packet_stream, so any number can be fed
+ * in turn from one thread.
+ */
+struct stream;
+
+struct stream_stats {
+	uint64_t bytes;
+	uint64_t packets;	/* Packets and aggregate records */
+	uint64_t samples;	/* Samples in them (as sent, not weighted) */
+	uint64_t missed;	/* Latest missed counts, summed over cores */
+};
+
+/* Bytes buffered per stream before a write (default 1MB). */
+void stream_set_buffer(size_t bytes);
+
+/*
+ * Create the trace file at path (which must not exist yet).  Returns
+ * NULL with errno set on failure.
+ */
+struct stream *stream_open(const char *path);
+
+/*
+ * Also split the stream live, as `splitter' would the trace file:  dir
+ * is created and gets setup.txt, a file per pid and, when the stream is
+ * closed, index.csv.  Call before the first stream_feed.  Returns 0, or
+ * -1 with errno set if dir can't be created.
+ */
+int stream_split(struct stream *s, const char *dir, int text);
+
+/* Append n bytes from the network.  Returns 0, or -1 on a write error. */
+int stream_feed(struct stream *s, void *data, size_t n);
+
+void stream_get_stats(const struct stream *s, struct stream_stats *st);
+
+/* Flush, close the file and free s.  Returns 0, or -1 on a write error. */
+int stream_close(struct stream *s);
+
+#endif
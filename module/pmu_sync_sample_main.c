@@ -83,6 +83,7 @@ exit:
 }
 
 DEFINE_PER_CPU(struct buffer*, lbuffer);
+DEFINE_PER_CPU(unsigned int, lmissed); // Dropped since this core's last buffer
 static struct blist  empty_buffers;
 static struct blist  full_buffers;
 
@@ -174,6 +175,12 @@ static struct int_attr missed_attr = {
     .value = 0,
 };
 
+static struct int_attr counters_attr = {
+    .attr.name="counters",
+    .attr.mode = 0444,
+    .value = 0,
+};
+
 static struct int_attr ctr0_attr = {
     .attr.name="0",
     .attr.mode = 0644,
@@ -200,8 +207,11 @@ static struct int_attr ctr3_attr = {
 
 
 static void initialize_buffer(struct buffer* b) {
-    b->core = smp_processor_id();
+    unsigned int proc = smp_processor_id();
+    b->core = proc;
     b->num_samples = 0;
+    b->missed = per_cpu(lmissed, proc);
+    per_cpu(lmissed, proc) = 0;
 }
 
 
@@ -216,6 +226,7 @@ void gatherSample(void) {
         if (b == NULL) {
             // No available buffers!
             missed_attr.value += 1;
+            per_cpu(lmissed, proc) += 1;
             return;
         }
         initialize_buffer(b);
@@ -306,6 +317,7 @@ static struct attribute * myattr[] = {
     &period_attr.attr,
     &status_attr.attr,
     &missed_attr.attr,
+    &counters_attr.attr,
     &ctr0_attr.attr,
     &ctr1_attr.attr,
     &ctr2_attr.attr,
@@ -376,6 +388,7 @@ int init_module(void)
     if ((rc =initialize_arch()) != 0) {
         return rc;
     }
+    counters_attr.value = num_ctrs;
 
     init_blist(&empty_buffers);
     init_blist(&full_buffers);
@@ -13,10 +13,11 @@ struct sample {
     unsigned int counters[6];
 };
 
-#define BUFFER_ENTRIES ((BUFFER_SIZE - 12) / sizeof(struct sample))
+#define BUFFER_ENTRIES ((BUFFER_SIZE - 3 * sizeof(unsigned int) - sizeof(void *)) / sizeof(struct sample))
 struct buffer {
     unsigned int core;
     unsigned int num_samples;
+    unsigned int missed;       // Samples dropped on this core since its previous buffer
     struct buffer *nextBuffer; // For linked list purposes
     struct sample samples[BUFFER_ENTRIES];
 };
@@ -6,76 +6,813 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <cstring>
+#include <errno.h>
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "../sender/packet.h"
 
 #include "reader.hpp"
+#include "trace.hpp"
 
-void read_file_loop(const char* fileName, void* file, size_t file_size) {
-        size_t position = strlen((char*)file) + 1;
-        struct sample samples[256];
-        struct packet_header pkt_head;
+/* Where streaming reads start; grows to fit the largest record */
+#define STREAM_BUFFER (1 << 20)
 
-        process_file(fileName, (const char*) file);
+/* Records per chunk when decoding in parallel */
+#define CHUNK_RECORDS (256)
 
-        while (position < file_size) {
+/* Bytes of a regular file mapped at a time */
+#define MAP_WINDOW (64 << 20)
+
+/* How often follow mode looks for more at the end of the file */
+#define FOLLOW_POLL_US (100000)
+
+/* read_range reads nearby records in one go, up to this much at a time */
+#define RANGE_SPAN (1 << 20)
+#define RANGE_GAP (64 << 10)
+
+/*
+ * The filter of the read going on, compiled for the checks made per
+ * packet:  pids sorted for a binary search, cores as a bitmap.  Only
+ * set up while a filtered read runs; read only, so decoding threads
+ * share it.
+ */
+static struct {
+        std::vector<uint32_t> pids;
+        uint64_t cores[4];
+        int kernel;
+        uint32_t min_batch, max_batch;
+        uint64_t min_cycles, max_cycles;
+        std::string exe;
+        bool any_cycles;
+} active;
+static bool filtering = false;
+
+static void start_filter(const struct read_filter& filter) {
+        active.pids = filter.pids;
+        std::sort(active.pids.begin(), active.pids.end());
+        memset(active.cores, filter.cores.empty() ? 0xff : 0, sizeof(active.cores));
+        for (size_t i = 0; i < filter.cores.size(); i++)
+                if (filter.cores[i] < 256)
+                        active.cores[filter.cores[i] / 64] |= 1ULL << (filter.cores[i] % 64);
+        active.kernel = filter.kernel;
+        active.min_batch = filter.min_batch;
+        active.max_batch = filter.max_batch;
+        active.min_cycles = filter.min_cycles;
+        active.max_cycles = filter.max_cycles;
+        active.any_cycles = filter.min_cycles == 0 && filter.max_cycles == UINT64_MAX;
+        active.exe = filter.exe;
+        filtering = true;
+}
+
+static inline bool pid_wanted(uint32_t pid) {
+        return active.pids.empty() ||
+               std::binary_search(active.pids.begin(), active.pids.end(), pid);
+}
+
+static inline bool core_wanted(unsigned core) {
+        return (active.cores[core / 64] >> (core % 64)) & 1;
+}
+
+static inline bool process_wanted(uint32_t pid, unsigned kernel, const char* exe) {
+        return pid_wanted(pid) &&
+               (active.kernel < 0 || (unsigned) active.kernel == kernel) &&
+               (active.exe.empty() || strstr(exe, active.exe.c_str()) != NULL);
+}
+
+/*
+ * Whether a packet may hold anything wanted, judged on its header alone.
+ * The header describes a multi-pid packet by its first process only, so
+ * those are judged on core and batch here and run by run later.
+ */
+static bool packet_wanted(const TraceRecord& r) {
+        const struct packet_header& head = r.header();
+
+        if (!core_wanted(head.core) ||
+            head.batch < active.min_batch || head.batch > active.max_batch)
+                return false;
+        return (packet_get_format() & PACKET_FORMAT_MULTIPID) ||
+               process_wanted(head.pid, head.kernel, r.exe());
+}
+
+static bool run_wanted(const struct packet_header& run, const char* exe,
+                       const struct sample* samples) {
+        if (!process_wanted(run.pid, run.kernel, exe))
+                return false;
+        if (active.any_cycles)
+                return true;
+        for (size_t i = 0; i < run.quantity; i++)
+                if (samples[i].cycles >= active.min_cycles && samples[i].cycles <= active.max_cycles)
+                        return true;
+        return false;
+}
+
+/*
+ * An aggregate record, filtered:  intervals by number (as the batch)
+ * and time in ms (as the cycles), entries by process and core.
+ */
+static void hand_aggregate(const TraceRecord& r) {
+        static thread_local std::vector<struct packet_aggregate> kept;
+        struct packet_interval interval = r.interval();
+        const struct packet_aggregate* entries = r.aggregates();
+
+        if (!filtering) {
+                process_aggregate(interval, entries);
+                return;
+        }
+        if (interval.number < active.min_batch || interval.number > active.max_batch ||
+            interval.start_ms + interval.length_ms < active.min_cycles ||
+            interval.start_ms > active.max_cycles)
+                return;
+        kept.clear();
+        for (size_t i = 0; i < interval.quantity; i++)
+                if (core_wanted(entries[i].core) &&
+                    process_wanted(entries[i].pid, entries[i].kernel, entries[i].exe))
+                        kept.push_back(entries[i]);
+        interval.quantity = kept.size();
+        if (!kept.empty())
+                process_aggregate(interval, &kept[0]);
+}
+
+/*
+ * Hand every whole record in data[0, size) to the client.  Returns the
+ * bytes used:  up to the first record that isn't all there yet, or, on
+ * malformed data, -1.  While filtering, packets are peeked at first and
+ * only decoded if their header passes, so retired processes are kept
+ * until the caller's packet_retire_skipped.
+ */
+static ssize_t dispatch_records(uint8_t* data, size_t size) {
+        TraceCursor cursor(data, size, 0);
+        TraceRecord r;
+        int rc;
+
+        while ((rc = cursor.next(r, !filtering)) > 0) {
+                if (r.kind() == TraceRecord::Aggregate) {
+                        /* For clients that take them */
+                        if (process_aggregate)
+                                hand_aggregate(r);
+                        continue;
+                }
+                if (!filtering) {
+                        /* Multi-pid packets reach clients one process at a time */
+                        r.forEachRun(process_packet);
+                        continue;
+                }
+                if (!packet_wanted(r))
+                        continue;
+                if (r.forEachRun([](struct packet_header run, const char* cmdline, const char* exe,
+                                    struct sample* samples) {
+                                if (run_wanted(run, exe, samples))
+                                        process_packet(run, cmdline, exe, samples);
+                        }))
+                        return -1;
+        }
+        return rc < 0 ? -1 : (ssize_t) cursor.position();
+}
+
+static int threads = 1;
+static size_t next_chunk = 0;
+
+void reader_set_threads(int n) {
+        threads = n > 0 ? n : 1;
+}
+
+/*
+ * dispatch_records on several threads.  One quick pass finds where the
+ * records are (and takes in process records, which must come first);
+ * then packets and aggregate records are decoded in chunks of
+ * CHUNK_RECORDS by a pool of threads, each chunk between chunk_begin and
+ * chunk_end, with the chunk_ends run in order.
+ */
+static ssize_t dispatch_parallel(uint8_t* data, size_t size) {
+        std::vector<std::pair<size_t, size_t> > records;
+        size_t position = 0;
+        bool malformed = false;
+        std::atomic<bool> failed(false);        /* A chunk hit a bad record */
+
+        while (position < size) {
                 size_t pbytes;
-                char* cmdline;
-                char* exe;
+                int rc = packet_skip(data + position, size - position, &pbytes);
+                if (rc == 1)
+                        break;
+                if (rc < 0) {
+                        malformed = true;
+                        break;
+                }
+                if (rc != 2)
+                        records.push_back(std::make_pair(position, pbytes));
+                position += pbytes;
+        }
+
+        long chunks = (records.size() + CHUNK_RECORDS - 1) / CHUNK_RECORDS;
+        size_t first_chunk = next_chunk;
+        next_chunk += chunks;
+
+        #pragma omp parallel for ordered schedule(dynamic, 1) num_threads(threads)
+        for (long c = 0; c < chunks; c++) {
+                size_t end = (c + 1) * CHUNK_RECORDS;
+                if (end > records.size())
+                        end = records.size();
+
+                chunk_begin(first_chunk + c);
+                for (size_t i = c * CHUNK_RECORDS; i < end; i++)
+                        if (dispatch_records(data + records[i].first, records[i].second) !=
+                            (ssize_t) records[i].second)
+                                failed = true;
+                #pragma omp ordered
+                chunk_end(first_chunk + c);
+        }
+        packet_retire_skipped();
+
+        return malformed || failed ? -1 : position;
+}
+
+/* Follow mode runs until the writer is done, which only the user knows */
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int sig) {
+        (void)(sig);
+        interrupted = 1;
+}
+
+/*
+ * Bytes read but not yet parsed, kept in one piece for packet_read.  The
+ * unparsed tail is moved back to the front when the free space at the
+ * end runs low, so the same memory is reused for the whole stream; it
+ * only grows if a single record won't fit.
+ */
+struct stream_buffer {
+        uint8_t* data;
+        size_t cap, head, tail;         /* Unparsed bytes are [head, tail) */
+};
+
+static int make_room(struct stream_buffer* b) {
+        if (b->head > 0 && b->cap - b->tail < b->cap / 4) {
+                memmove(b->data, b->data + b->head, b->tail - b->head);
+                b->tail -= b->head;
+                b->head = 0;
+        }
+        if (b->cap - b->tail < 2) {
+                uint8_t* bigger = (uint8_t*) realloc(b->data, b->cap * 2);
+                if (bigger == NULL)
+                        return -1;
+                b->data = bigger;
+                b->cap *= 2;
+        }
+        return 0;
+}
+
+int read_fd(const char* fileName, int fd, bool follow) {
+        struct stream_buffer b = { (uint8_t*) malloc(STREAM_BUFFER), STREAM_BUFFER, 0, 0 };
+        struct sigaction sa, old_int, old_term;
+        bool described = false;
+        int ret = 0;
 
-                void* currPos = &(((uint8_t*)file)[position]);
-                int rc = packet_read(currPos, file_size - position,
-                                                         &pkt_head, samples, &cmdline, &exe,
-                                                         &pbytes);
-                if (rc != 0) {
-                        fprintf(stderr, "Error reading packet. Position: %lu, file_size: %lu\n",
-                                        position, file_size);
+        if (b.data == NULL) {
+                fprintf(stderr, "Out of memory reading %s\n", fileName);
+                return 1;
+        }
+        /* A pipe or socket at end of file is done for good */
+        struct stat info;
+        if (follow && (fstat(fd, &info) || !S_ISREG(info.st_mode)))
+                follow = false;
+        if (follow) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = on_interrupt;
+                interrupted = 0;
+                sigaction(SIGINT, &sa, &old_int);
+                sigaction(SIGTERM, &sa, &old_term);
+        }
+
+        for (;;) {
+                if (make_room(&b)) {
+                        fprintf(stderr, "Out of memory reading %s\n", fileName);
+                        ret = 1;
+                        break;
+                }
+                /* Leave a byte to terminate a description cut short */
+                ssize_t rc = read(fd, b.data + b.tail, b.cap - b.tail - 1);
+                if (rc < 0 && errno == EINTR && !interrupted)
+                        continue;
+                if (rc < 0 && errno != EINTR) {
+                        perror("Error reading stream");
+                        ret = 1;
                         break;
                 }
+                if (rc == 0 && follow && !interrupted) {
+                        /* Nothing new yet; the file is still being written */
+                        usleep(FOLLOW_POLL_US);
+                        continue;
+                }
+                if (rc <= 0)
+                        break;
+                b.tail += rc;
 
-                process_packet(pkt_head, cmdline, exe, samples);
+                if (!described) {
+                        uint8_t* end = (uint8_t*) memchr(b.data, '\0', b.tail);
+                        if (end == NULL)
+                                continue;
+                        packet_set_format(packet_parse_format((const char*) b.data));
+                        process_file(fileName, (const char*) b.data);
+                        described = true;
+                        b.head = end - b.data + 1;
+                }
 
-                position += pbytes;
+                ssize_t used = dispatch_records(b.data + b.head, b.tail - b.head);
+                packet_retire_skipped();
+                if (used < 0) {
+                        fprintf(stderr, "Error reading packet. Position: %lu\n", b.head);
+                        ret = 1;
+                        break;
+                }
+                b.head += used;
+        }
+
+        if (!described && ret == 0) {
+                /* Hand over whatever description there was */
+                b.data[b.tail] = '\0';
+                process_file(fileName, (const char*) b.data);
+        } else if (ret == 0 && b.head < b.tail) {
+                fprintf(stderr, "Stream ended inside a packet; %lu bytes left over\n",
+                                b.tail - b.head);
+        }
+
+        if (follow) {
+                sigaction(SIGINT, &old_int, NULL);
+                sigaction(SIGTERM, &old_term, NULL);
+        }
+        free(b.data);
+        return ret;
+}
+
+int follow_file(const char* fileName) {
+        int fd = strcmp(fileName, "-") ? open(fileName, O_RDONLY) : STDIN_FILENO;
+        if (fd == -1) {
+                perror("Error opening file for reading");
+                return 1;
         }
+        int rc = read_fd(fileName, fd, true);
+        if (fd != STDIN_FILENO)
+                close(fd);
+        return rc;
 }
 
+/* What read_mapped does with a file's description and records */
+struct map_client {
+        void (*describe)(const char* fileName, const char* desc);
+        /* As dispatch_records; offset is where data is in the file */
+        ssize_t (*records)(uint8_t* data, size_t size, uint64_t offset);
+};
+
+/*
+ * Walk a regular file through a sliding window of mappings, so traces
+ * of any size fit in a 32-bit address space and RSS stays near one
+ * window.  The kernel is told each window is read sequentially, the
+ * next one is read ahead while this one is parsed and what has been
+ * parsed is dropped from the page cache.  A record cut off by the end
+ * of a window is parsed again from the start of the next.
+ */
+static int read_mapped(const char* fileName, int fd, uint64_t file_size,
+                       const struct map_client& client) {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t position = 0;          /* First byte not parsed yet */
+        size_t window = MAP_WINDOW;
+        bool described = false;
+
+        while (position < file_size) {
+                uint64_t base = position - position % page;
+                size_t len = file_size - base < window ? file_size - base : window;
+                bool last = (base + len == file_size);
+
+                void* map = mmap(0, len, PROT_READ, MAP_SHARED, fd, base);
+                if (map == MAP_FAILED) {
+                        perror("Error mmapping file");
+                        return 1;
+                }
+                madvise(map, len, MADV_SEQUENTIAL);
+                if (!last)
+                        posix_fadvise(fd, base + len, window, POSIX_FADV_WILLNEED);
+
+                uint8_t* data = (uint8_t*) map + (position - base);
+                size_t avail = len - (position - base);
+                size_t used = 0;
+                ssize_t n = 0;
+
+                if (!described) {
+                        uint8_t* end = (uint8_t*) memchr(data, '\0', avail);
+                        if (end != NULL) {
+                                packet_set_format(packet_parse_format((const char*) data));
+                                client.describe(fileName, (const char*) data);
+                                described = true;
+                                used = end - data + 1;
+                        } else if (last) {
+                                fprintf(stderr, "Error reading description: no end in %s\n", fileName);
+                                munmap(map, len);
+                                return 1;
+                        }
+                }
+                if (described)
+                        n = client.records(data + used, avail - used, position + used);
+
+                if (munmap(map, len) == -1)
+                        perror("Error unmapping file");
+                if (n < 0) {
+                        fprintf(stderr, "Error reading packet. Position: %llu, file_size: %llu\n",
+                                        (unsigned long long) (position + used),
+                                        (unsigned long long) file_size);
+                        break;
+                }
+                position += used + n;
+                if (last) {
+                        if (position < file_size)
+                                fprintf(stderr, "Error reading packet. Position: %llu, file_size: %llu\n",
+                                                (unsigned long long) position,
+                                                (unsigned long long) file_size);
+                        break;
+                }
+                if (used + n == 0) {
+                        /* One record is bigger than the window */
+                        window *= 2;
+                        continue;
+                }
+                posix_fadvise(fd, base, position - base, POSIX_FADV_DONTNEED);
+        }
+        return 0;
+}
+
+static ssize_t dispatch_window(uint8_t* data, size_t size, uint64_t offset) {
+        (void)(offset);
+        if (threads > 1 && chunk_begin && chunk_end)
+                return dispatch_parallel(data, size);
+        ssize_t used = dispatch_records(data, size);
+        packet_retire_skipped();
+        return used;
+}
+
+static const struct map_client read_client = { process_file, dispatch_window };
+
+int read_file(const char* fileName, const struct read_filter& filter) {
+        start_filter(filter);
+        int rc = read_file(fileName);
+        filtering = false;
+        return rc;
+}
 
 int read_file(const char* fileName) {
         int fd;
-        void* file;
         struct stat file_info;
-        size_t filesize;
+        int rc;
+
+        if (strcmp(fileName, "-") == 0)
+                return read_fd(fileName, STDIN_FILENO, false);
 
         if (stat(fileName, &file_info) == -1) {
                 perror("Error stat'ing file");
                 return 1;
         }
 
-        filesize = file_info.st_size;
-
         fd = open(fileName, O_RDONLY);
         if (fd == -1) {
                 perror("Error opening file for reading");
                 return 1;
         }
 
-        file = mmap(0, filesize, PROT_READ, MAP_SHARED, fd, 0);
-        if (file == MAP_FAILED) {
-                perror("Error mmapping file");
-                close(fd);
-                return 1;
+        /* Pipes, sockets and devices can't be mapped; stream them */
+        if (S_ISREG(file_info.st_mode))
+                rc = read_mapped(fileName, fd, file_info.st_size, read_client);
+        else
+                rc = read_fd(fileName, fd, false);
+
+        if (close(fd)) {
+                perror("Error closing file");
         }
 
-        read_file_loop(fileName, file, filesize);
+        return rc;
+}
+
+/*
+ * The index read_range keeps next to a trace, in fileName.idx:  a
+ * header, then an entry per process record, aggregate record and (pid,
+ * packet) pair, sorted by (kind, pid, core, offset) so the packets of a
+ * pid, or of a pid on one core, are a binary search away.  Entries are
+ * in host byte order; the index is rebuilt whenever the trace's size or
+ * mtime no longer match.
+ */
+#define INDEX_MAGIC "PMUIDX1"
+
+enum index_kind {
+        INDEX_PROCESS,
+        INDEX_AGGREGATE,
+        INDEX_PACKET
+};
 
-        if (munmap(file, filesize) == -1) {
-                perror("Error unmapping file");
+struct index_header {
+        char magic[8];
+        uint64_t trace_size;
+        int64_t trace_mtime_sec, trace_mtime_nsec;
+        uint64_t desc_length;
+        uint64_t entries;
+};
+
+struct index_entry {
+        uint64_t offset;
+        /* Packets:  lowest and highest cycles of the pid's samples.
+           Aggregate records:  the interval, in ms since the epoch. */
+        uint64_t first_cycles, last_cycles;
+        uint32_t length;
+        uint32_t pid;
+        uint32_t batch;         /* Aggregate records:  interval number */
+        uint8_t core;
+        uint8_t kind;
+        uint8_t kernel;
+        uint8_t unused;
+};
+
+static bool index_order(const struct index_entry& a, const struct index_entry& b) {
+        if (a.kind != b.kind)
+                return a.kind < b.kind;
+        if (a.pid != b.pid)
+                return a.pid < b.pid;
+        if (a.core != b.core)
+                return a.core < b.core;
+        return a.offset < b.offset;
+}
+
+/* Entries of a trace being indexed */
+static std::vector<struct index_entry> building;
+static uint64_t building_desc;
+
+static void index_describe(const char* fileName, const char* desc) {
+        (void)(fileName);
+        building_desc = strlen(desc);
+}
+
+static ssize_t index_records(uint8_t* data, size_t size, uint64_t offset) {
+        static struct sample samples[PACKET_MAX_SAMPLES];
+        struct packet_header head;
+        size_t position = 0;
+
+        while (position < size) {
+                struct index_entry e;
+                size_t pbytes;
+                char* cmdline;
+                char* exe;
+
+                int rc = packet_read(data + position, size - position,
+                                     &head, samples, &cmdline, &exe, &pbytes);
+                if (rc == 1)
+                        break;
+                if (rc < 0)
+                        return -1;
+
+                memset(&e, 0, sizeof(e));
+                e.offset = offset + position;
+                e.length = pbytes;
+                if (rc == 2) {
+                        e.kind = INDEX_PROCESS;
+                        building.push_back(e);
+                } else if (rc == 3) {
+                        struct packet_interval interval;
+                        packet_aggregates(&interval);
+                        e.kind = INDEX_AGGREGATE;
+                        e.batch = interval.number;
+                        e.first_cycles = interval.start_ms;
+                        e.last_cycles = interval.start_ms + interval.length_ms;
+                        building.push_back(e);
+                } else {
+                        /* An entry per pid in the packet */
+                        size_t first = building.size();
+                        e.kind = INDEX_PACKET;
+                        e.core = head.core;
+                        e.kernel = head.kernel;
+                        e.batch = head.batch;
+                        for (size_t i = 0; i < head.quantity; i++) {
+                                size_t j = first;
+                                while (j < building.size() && building[j].pid != samples[i].pid)
+                                        j++;
+                                if (j == building.size()) {
+                                        e.pid = samples[i].pid;
+                                        e.first_cycles = e.last_cycles = samples[i].cycles;
+                                        building.push_back(e);
+                                } else {
+                                        building[j].first_cycles = std::min<uint64_t>(building[j].first_cycles, samples[i].cycles);
+                                        building[j].last_cycles = std::max<uint64_t>(building[j].last_cycles, samples[i].cycles);
+                                }
+                        }
+                }
+                position += pbytes;
         }
+        return position;
+}
 
-        if (close(fd)) {
-                perror("Error closing file");
+static const struct map_client index_client = { index_describe, index_records };
+
+/* Write the index built for a trace; a failure only costs the next query */
+static void save_index(const std::string& path, const struct index_header& header) {
+        std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (f == NULL) {
+                fprintf(stderr, "Not saving index %s: %s\n", path.c_str(), strerror(errno));
+                return;
         }
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        if (ok && !building.empty())
+                ok = fwrite(&building[0], sizeof(struct index_entry), building.size(), f) == building.size();
+        if (fclose(f) || !ok || rename(tmp.c_str(), path.c_str())) {
+                fprintf(stderr, "Not saving index %s: %s\n", path.c_str(), strerror(errno));
+                unlink(tmp.c_str());
+        }
+}
 
+/* The index of a trace, mapped from fileName.idx or built in memory */
+struct trace_index {
+        struct index_header header;
+        const struct index_entry* entries;
+        void* map;
+        size_t map_len;
+};
+
+static bool map_index(const std::string& path, const struct stat& trace, struct trace_index* index) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd == -1)
+                return false;
+        if (fstat(fd, &info) || (size_t) info.st_size < sizeof(struct index_header)) {
+                close(fd);
+                return false;
+        }
+        void* map = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return false;
+
+        const struct index_header* h = (const struct index_header*) map;
+        if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) ||
+            h->trace_size != (uint64_t) trace.st_size ||
+            h->trace_mtime_sec != trace.st_mtim.tv_sec ||
+            h->trace_mtime_nsec != trace.st_mtim.tv_nsec ||
+            (uint64_t) info.st_size != sizeof(*h) + h->entries * sizeof(struct index_entry)) {
+                munmap(map, info.st_size);
+                return false;
+        }
+        index->header = *h;
+        index->entries = (const struct index_entry*) (h + 1);
+        index->map = map;
+        index->map_len = info.st_size;
+        return true;
+}
+
+static int load_index(const char* fileName, int fd, const struct stat& trace,
+                      struct trace_index* index) {
+        std::string path = std::string(fileName) + ".idx";
+
+        if (map_index(path, trace, index))
+                return 0;
+
+        building.clear();
+        building_desc = 0;
+        if (read_mapped(fileName, fd, trace.st_size, index_client))
+                return 1;
+        std::sort(building.begin(), building.end(), index_order);
+
+        memset(&index->header, 0, sizeof(index->header));
+        memcpy(index->header.magic, INDEX_MAGIC, sizeof(index->header.magic));
+        index->header.trace_size = trace.st_size;
+        index->header.trace_mtime_sec = trace.st_mtim.tv_sec;
+        index->header.trace_mtime_nsec = trace.st_mtim.tv_nsec;
+        index->header.desc_length = building_desc;
+        index->header.entries = building.size();
+        index->entries = building.empty() ? NULL : &building[0];
+        index->map = NULL;
+        index->map_len = 0;
+        save_index(path, index->header);
         return 0;
 }
 
+/* First entry at or after (kind, pid, core), or past it with after */
+static const struct index_entry* index_find(const struct trace_index& index, uint8_t kind,
+                                            uint32_t pid, uint8_t core, bool after) {
+        struct index_entry key;
+        memset(&key, 0, sizeof(key));
+        key.kind = kind;
+        key.pid = pid;
+        key.core = core;
+        key.offset = after ? UINT64_MAX : 0;
+
+        const struct index_entry* end = index.entries + index.header.entries;
+        return after ? std::upper_bound(index.entries, end, key, index_order)
+                     : std::lower_bound(index.entries, end, key, index_order);
+}
+
+/* Whether read_range should read an indexed record (active set up) */
+static bool entry_wanted(const struct index_entry& e) {
+        if (e.kind == INDEX_PROCESS)
+                return true;
+        if (e.kind == INDEX_PACKET && (!pid_wanted(e.pid) || !core_wanted(e.core)))
+                return false;
+        return e.batch >= active.min_batch && e.batch <= active.max_batch &&
+               e.last_cycles >= active.min_cycles && e.first_cycles <= active.max_cycles;
+}
+
+/* Read the picked records in file order, nearby ones with one pread */
+static int deliver(const char* fileName, int fd, std::vector<const struct index_entry*>& picked) {
+        std::vector<uint8_t> span;
+
+        std::sort(picked.begin(), picked.end(),
+                  [](const struct index_entry* a, const struct index_entry* b) {
+                          return a->offset < b->offset;
+                  });
+        for (size_t i = 0; i < picked.size(); ) {
+                uint64_t start = picked[i]->offset;
+                uint64_t end = start + picked[i]->length;
+                size_t j = i + 1;
+                while (j < picked.size() && picked[j]->offset <= end + RANGE_GAP &&
+                       picked[j]->offset + picked[j]->length - start <= RANGE_SPAN) {
+                        end = std::max<uint64_t>(end, picked[j]->offset + picked[j]->length);
+                        j++;
+                }
+
+                span.resize(end - start);
+                if (pread(fd, &span[0], end - start, start) != (ssize_t) (end - start)) {
+                        fprintf(stderr, "Error reading %s at %llu\n", fileName,
+                                        (unsigned long long) start);
+                        return 1;
+                }
+                for (; i < j; i++) {
+                        /* Several pids of one packet may have been picked */
+                        if (i > 0 && picked[i]->offset == picked[i - 1]->offset)
+                                continue;
+                        ssize_t used = dispatch_records(&span[picked[i]->offset - start], picked[i]->length);
+                        packet_retire_skipped();
+                        if (used != (ssize_t) picked[i]->length) {
+                                fprintf(stderr, "Error reading packet. Position: %llu; index out of date?\n",
+                                                (unsigned long long) picked[i]->offset);
+                                return 1;
+                        }
+                }
+        }
+        return 0;
+}
+
+int read_range(const char* fileName, const struct read_filter& filter) {
+        struct trace_index index;
+        struct stat info;
+        int rc = 1;
+
+        int fd = open(fileName, O_RDONLY);
+        if (fd == -1) {
+                perror("Error opening file for reading");
+                return 1;
+        }
+        if (fstat(fd, &info) || !S_ISREG(info.st_mode)) {
+                fprintf(stderr, "%s: read_range needs a regular file\n", fileName);
+                close(fd);
+                return 1;
+        }
+        if (load_index(fileName, fd, info, &index)) {
+                close(fd);
+                return 1;
+        }
+
+        std::vector<char> desc(index.header.desc_length + 1);
+        if (pread(fd, &desc[0], desc.size(), 0) != (ssize_t) desc.size() || desc.back() != '\0') {
+                fprintf(stderr, "Error reading description: no end in %s\n", fileName);
+        } else {
+                packet_set_format(packet_parse_format(&desc[0]));
+                process_file(fileName, &desc[0]);
+
+                /* Every process record (the table is small), then the
+                   aggregates and the packets of the pids wanted */
+                std::vector<const struct index_entry*> picked;
+                const struct index_entry* from = index.entries;
+                const struct index_entry* packets = index_find(index, INDEX_PACKET, 0, 0, false);
+                const struct index_entry* to = filter.pids.empty() ?
+                        index.entries + index.header.entries : packets;
+
+                start_filter(filter);
+                for (; from < to; from++)
+                        if (entry_wanted(*from))
+                                picked.push_back(from);
+                for (size_t i = 0; i < active.pids.size(); i++) {
+                        if (i > 0 && active.pids[i] == active.pids[i - 1])
+                                continue;
+                        from = index_find(index, INDEX_PACKET, active.pids[i], 0, false);
+                        to = index_find(index, INDEX_PACKET, active.pids[i], UINT8_MAX, true);
+                        for (; from < to; from++)
+                                if (entry_wanted(*from))
+                                        picked.push_back(from);
+                }
+                rc = deliver(fileName, fd, picked);
+                filtering = false;
+        }
+
+        if (index.map)
+                munmap(index.map, index.map_len);
+        building.clear();
+        close(fd);
+        return rc;
+}
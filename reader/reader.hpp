@@ -1,14 +1,76 @@
 #ifndef __READER_HPP_
 #define __READER_HPP_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 // Defined by client 
 extern void process_packet(struct packet_header head,
 					const char* cmdline, const char* exe,
 					struct sample* samples);
 extern void process_file(const char* fileName, const char* desc);
 
-// Defined by library
+// Optional; clients that want --aggregate intervals define it
+extern void process_aggregate(const struct packet_interval& interval,
+					const struct packet_aggregate* entries) __attribute__((weak));
+
+// Optional; clients that can take packets on several threads at once
+// define both.  With reader_set_threads(n > 1), regular files are then
+// decoded in chunks of packets by a pool of threads.  All of a chunk's
+// process_packet (and process_aggregate) calls happen on one thread,
+// after chunk_begin(chunk) there; chunk_end(chunk) follows on the same
+// thread, but the chunk_ends run one at a time and in chunk order, so
+// they can merge what each chunk produced.  cmdline and exe stay good
+// until chunk_end.
+extern void chunk_begin(size_t chunk) __attribute__((weak));
+extern void chunk_end(size_t chunk) __attribute__((weak));
+
+// Defined by library; decode on this many threads where clients allow
+// (1, the default, decodes everything in order on the calling thread)
+extern void reader_set_threads(int threads);
+
+// Defined by library; a fileName of "-" reads standard input.  Regular
+// files are mapped, anything else is streamed through read_fd.
 extern int read_file(const char* fileName);
 
+// Parse the stream on fd as it arrives:  a pipe, socket or file.  Records
+// split across reads are put back together.  With follow, end of file
+// means "wait for more" (like tail -f) until SIGINT or SIGTERM, so a
+// file the sender or collector is still writing can be read live.
+extern int read_fd(const char* fileName, int fd, bool follow);
+
+// What a filtered read_file, or read_range, hands over.  A default
+// constructed filter takes everything; narrow what matters.
+struct read_filter {
+	std::vector<uint32_t> pids;		// Any of these; empty: any pid
+	std::vector<unsigned> cores;		// Any of these; empty: any core
+	int kernel;				// 1 kernel, 0 user, -1 either
+	uint32_t min_batch, max_batch;		// Inclusive
+	uint64_t min_cycles, max_cycles;	// Runs with a sample in range
+	std::string exe;			// Part of the exe; empty: any
+
+	read_filter() : kernel(-1), min_batch(0), max_batch(UINT32_MAX),
+		min_cycles(0), max_cycles(UINT64_MAX) { }
+};
+
+// Defined by library; read_file handing over only what filter takes.
+// Packets are judged on their header (and exe) before any samples are
+// decoded, and skipped if they fail.  Multi-pid packets are decoded if
+// their core and batch pass, then judged run by run.  Aggregate records
+// are picked by interval number (as the batch) and time in ms (as the
+// cycles), and pass on only their entries that match.
+extern int read_file(const char* fileName, const struct read_filter& filter);
+
+// Defined by library; the filtered read_file, but going straight to the
+// packets of the pids wanted through an index of the trace, in
+// fileName.idx, built on first use (and again whenever the trace
+// changes).  Without pids, every packet's index entry is looked at.
+extern int read_range(const char* fileName, const struct read_filter& filter);
+
+// read_fd on fileName ("-" for standard input) with follow on
+extern int follow_file(const char* fileName);
+
 #endif // __READER_HPP_
 
@@ -0,0 +1,335 @@
+#include <cstdio>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cassert>
+#include <errno.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+
+#include "splitter.hpp"
+#include "../sender/csv_writer.h"
+
+using namespace std;
+
+static const uint32_t zeros[7] = {0, 0, 0, 0, 0, 0, 0};
+
+static const char textBreak[] = ",,,,,,\n";
+
+static void putbinstr(const char* str, string& out) {
+	out.append(str, strlen(str) + 1);
+}
+
+static int outputStringToFile(const char* fn, const char* str) {
+	int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror("Opening file");
+		return -1;
+	}
+
+	size_t dlen = strlen(str);
+	ssize_t wrc = write(fd, str, dlen);
+	close(fd);
+	if (wrc < 0) {
+		perror("writing to file");
+		return -1;
+	}
+	return 0;
+}
+
+static int writeAll(int fd, const char* data, size_t len) {
+	while (len) {
+		ssize_t rc = write(fd, data, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			perror("Error writing data file");
+			return -1;
+		}
+		data += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+void Splitter::FileInfo::writeIndex(FILE* indexfd) {
+	if (indexfd)
+		fprintf(indexfd, "%u,%s,%s,%s\n", pid,
+				cmdline.c_str(), exe.c_str(), fileName.c_str());
+}
+
+// Pid files open in every splitter of the process (the collector has one
+// per stream), and how many they may have between them:  half the
+// descriptors a process may have, to leave room for everything else
+static std::atomic<size_t> splitters;
+static std::atomic<size_t> openFiles;
+
+static size_t openBudget() {
+	static const size_t budget = [] {
+		struct rlimit lim;
+
+		if (getrlimit(RLIMIT_NOFILE, &lim) || lim.rlim_cur == RLIM_INFINITY)
+			return (size_t) SIZE_MAX;
+		return lim.rlim_cur / 2 > 1 ? (size_t) (lim.rlim_cur / 2) : 1;
+	}();
+	return budget;
+}
+
+Splitter::Splitter(const char* topDir, Format format, size_t maxOpen) :
+	topDir(topDir), format(format), failed(false), indexfd(NULL),
+	maxOpen(maxOpen ? maxOpen : 1), open_files(this->maxOpen) {
+	++splitters;
+}
+
+Splitter::~Splitter() {
+	finish();
+	--splitters;
+}
+
+int Splitter::start(const char* desc) {
+	string setup = topDir + "/setup.txt";
+	string index = topDir + "/index.csv";
+
+	if (outputStringToFile(setup.c_str(), desc)) {
+		failed = true;
+		return -1;
+	}
+	indexfd = fopen(index.c_str(), "w");
+	if (indexfd == NULL) {
+		perror("Error opening index file for output: ");
+		failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+void Splitter::finish() {
+	FILE* index = indexfd;
+
+	// Breaks owed to files closed since are their last records
+	pid_files.for_each([this](uint32_t pid, FileInfo& info) {
+		if (!info.breaks || failed)
+			return;
+		trimFiles(true);
+		OpenFile& file = open_files[pid];
+		if (openFile(info, file) || stageBreaks(file, info.breaks))
+			failed = true;
+		info.breaks = 0;
+	});
+	open_files.for_each([this](uint32_t, OpenFile& file) {
+		closeFile(file);
+	});
+	open_files.clear();
+
+	pid_files.for_each([index](uint32_t, FileInfo& info) {
+		info.writeIndex(index);
+	});
+	pid_files.clear();
+
+	if (indexfd)
+		fclose(indexfd);
+	indexfd = NULL;
+	for (unsigned i = 0; i < MaxCores; i++)
+		cores[i] = CoreOutput();
+}
+
+// Open info's file:  created the first time, appended to after that
+int Splitter::openFile(FileInfo& info, OpenFile& file) {
+	bool created = !info.fileName.empty();
+	char fn[PATH_MAX], fn2[PATH_MAX];
+
+	snprintf(fn, PATH_MAX, "%s/%u.csv", topDir.c_str(), info.pid);
+	file.fd = open(fn, O_WRONLY | O_CREAT | (created ? O_APPEND : O_TRUNC), 0666);
+	if (file.fd < 0) {
+		perror("Error opening new data file");
+		return -1;
+	}
+	++openFiles;
+	file.staged.reserve(StageSize);
+	if (created)
+		return 0;
+
+	if (realpath(fn, fn2) == NULL) {
+		perror("Error resolving realpath: ");
+		return -1;
+	}
+	info.fileName = fn2;
+
+	switch(format) {
+		case Text:
+			file.staged += info.cmdline + ", " + info.exe + "\n";
+			break;
+		case Binary:
+			putbinstr("Trace binary file\n", file.staged);
+			putbinstr(info.cmdline.c_str(), file.staged);
+			putbinstr(info.exe.c_str(), file.staged);
+			break;
+		default:
+			assert(false);
+	}
+	return 0;
+}
+
+// Queue data for the file, writing out what is staged once it's full.
+// Anything as big as the buffer goes straight out.
+int Splitter::stage(OpenFile& file, const char* data, size_t len) {
+	if (file.staged.size() + len > StageSize && flushFile(file))
+		return -1;
+	if (len >= StageSize)
+		return writeAll(file.fd, data, len);
+	file.staged.append(data, len);
+	return 0;
+}
+
+// n of the records that mark where a core's run of samples ended
+int Splitter::stageBreaks(OpenFile& file, unsigned n) {
+	for (; n; n--) {
+		int rc = format == Text ? stage(file, textBreak, sizeof(textBreak) - 1)
+								: stage(file, (const char*) zeros, sizeof(zeros));
+		if (rc)
+			return -1;
+	}
+	return 0;
+}
+
+int Splitter::flushFile(OpenFile& file) {
+	int rc = 0;
+
+	if (file.fd >= 0)
+		rc = writeAll(file.fd, file.staged.data(), file.staged.size());
+	file.staged.clear();
+	return rc;
+}
+
+void Splitter::closeFile(OpenFile& file) {
+	if (flushFile(file))
+		failed = true;
+	if (file.fd >= 0) {
+		close(file.fd);
+		--openFiles;
+	}
+	file.fd = -1;
+}
+
+// Close files down to this splitter's share of the budget, and when about
+// to open one with the budget used up, close one of ours first.  Nothing
+// may hold on to an OpenFile here.
+void Splitter::trimFiles(bool opening) {
+	size_t keep = std::min(maxOpen, std::max<size_t>(openBudget() / splitters, 1));
+
+	if (opening && openFiles >= openBudget() && open_files.size() &&
+		open_files.size() - 1 < keep)
+		keep = open_files.size() - 1;
+	open_files.trim([this](uint32_t, OpenFile& file) {
+		closeFile(file);
+	}, keep);
+}
+
+Splitter::OpenFile* Splitter::checkIncrFile(CoreOutput& core, struct packet_header new_head,
+											const char* cmdline, const char* exe) {
+
+	if (!core.has_last_head ||
+		core.last_head.pid != new_head.pid) {
+
+		// The pid this core leaves gets a break, now or when reopened
+		if (core.has_last_head) {
+			OpenFile* last = open_files.peek(core.last_head.pid);
+			if (last == NULL)
+				pid_files.find(core.last_head.pid)->breaks++;
+			else if (stageBreaks(*last, 1))
+				return NULL;
+		}
+
+		core.has_last_head = true;
+		core.last_head = new_head;
+	}
+
+	// Update info
+	auto& currInfo = pid_files[new_head.pid];
+	currInfo.pid = new_head.pid;
+	currInfo.cmdline = cmdline;
+	currInfo.exe = exe;
+
+	OpenFile* file = open_files.find(new_head.pid);
+	if (file == NULL) {
+		trimFiles(true);
+		file = &open_files[new_head.pid];
+		if (openFile(currInfo, *file) || stageBreaks(*file, currInfo.breaks))
+			return NULL;
+		currInfo.breaks = 0;
+	}
+	return file;
+}
+
+// Longest line a Text sample can make
+#define MAX_TEXT_LINE (CSV_MAX_U64 + 6 * (CSV_MAX_U32 + 1) + 1)
+
+void Splitter::formatSamples(Format format, const struct sample* samples,
+							 size_t n, string& out) {
+	size_t at = out.size();
+	out.resize(at + n * (format == Text ? MAX_TEXT_LINE + 1 : 7 * sizeof(uint32_t)));
+	char* p = &out[at];
+
+	for (size_t i=0; i<n; i++) {
+		const struct sample& c = samples[i];
+		switch (format) {
+			case Text:
+				p = csv_u64(p, c.cycles);
+				for (size_t j=0; j<6; j++) {
+					*p++ = ',';
+					p = csv_u32(p, c.counters[j]);
+				}
+				*p++ = '\n';
+				break;
+			case Binary: {
+				uint32_t nums[7] = {
+					(uint32_t)c.cycles,
+					c.counters[0], c.counters[1], c.counters[2],
+					c.counters[3], c.counters[4], c.counters[5] };
+				memcpy(p, nums, sizeof(nums));
+				p += sizeof(nums);
+				break;
+			}
+			default:
+				assert(false);
+		}
+	}
+	out.resize(p - out.data());
+}
+
+int Splitter::packet(struct packet_header head,
+					 const char* cmdline, const char* exe,
+					 struct sample* samples) {
+	formatted.clear();
+	formatSamples(format, samples, head.quantity, formatted);
+	return writeSamples(head, cmdline, exe, formatted.data(), formatted.size());
+}
+
+int Splitter::writeSamples(struct packet_header head,
+						   const char* cmdline, const char* exe,
+						   const char* data, size_t len) {
+	if (failed)
+		return -1;
+	if (head.core >= MaxCores) {
+		fprintf(stderr, "Possible data corruption: head.core (%d) more than %u. Skipping packet\n",
+				head.core, MaxCores - 1);
+		return 0;
+	}
+
+	// Nothing holds on to open files between packets
+	trimFiles();
+	if (failed)
+		return -1;
+
+	OpenFile* file = checkIncrFile(cores[head.core], head, cmdline, exe);
+	if (file == NULL || stage(*file, data, len)) {
+		failed = true;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef __SPLITTER_HPP_
+#define __SPLITTER_HPP_
+
+#include <cstdio>
+#include <string>
+#include <stdint.h>
+
+#include "../sender/flat_table.h"
+#include "../sender/packet.h"
+
+// Demultiplexes one stream's packets into a directory:  setup.txt with
+// the experiment info, a <pid>.csv per process (text or binary) and, once
+// finished, index.csv listing them.  Packets may come in as they arrive;
+// per pid only its index.csv line is kept.  About maxOpen pid files are
+// open at a time, least recently used closed first, each with a buffer of
+// StageSize bytes so samples go out in large writes.  All the splitters
+// of a process share half its descriptor limit, so with many of them
+// each keeps fewer.  A file closed to make room is appended to when its
+// pid comes back.
+class Splitter {
+public:
+	enum Format {
+		Text,
+		Binary
+	};
+
+	static const unsigned MaxCores = 16;
+	static const size_t DefaultMaxOpen = 128;
+	static const size_t StageSize = 64 * 1024;
+
+	Splitter(const char* topDir, Format format, size_t maxOpen = DefaultMaxOpen);
+	~Splitter();
+
+	// Write setup.txt and open index.csv.  Returns 0, or -1 on error.
+	int start(const char* desc);
+
+	// One single-process run of samples (see packet_run).  Returns 0, or
+	// -1 if the output can't be written; the splitter stops there.
+	int packet(struct packet_header head, const char* cmdline, const char* exe,
+			   struct sample* samples);
+
+	// packet() in two halves, so runs can be formatted on other threads:
+	// append a run's samples to out as they go in a pid file, then write
+	// the runs in the order they came.  writeSamples returns as packet does.
+	static void formatSamples(Format format, const struct sample* samples,
+							  size_t n, std::string& out);
+	int writeSamples(struct packet_header head, const char* cmdline, const char* exe,
+					 const char* data, size_t len);
+
+	// Close every file and write index.csv.
+	void finish();
+
+private:
+	struct FileInfo {
+		uint32_t pid;
+		std::string exe, cmdline;
+		std::string fileName;	// Empty until the file is created
+		unsigned breaks;		// Owed to the file while it is closed
+
+		FileInfo() : pid(0), breaks(0) { }
+
+		void writeIndex(FILE* indexfd);
+	};
+
+	// A pid file open for writing, and what is staged for it
+	struct OpenFile {
+		int fd;
+		std::string staged;
+
+		OpenFile() : fd(-1) { }
+	};
+
+	struct CoreOutput {
+		bool has_last_head;
+		struct packet_header last_head;
+
+		CoreOutput() : has_last_head(false) { }
+	};
+
+	OpenFile* checkIncrFile(CoreOutput& core, struct packet_header new_head,
+							const char* cmdline, const char* exe);
+	int openFile(FileInfo& info, OpenFile& file);
+	int stage(OpenFile& file, const char* data, size_t len);
+	int stageBreaks(OpenFile& file, unsigned n);
+	int flushFile(OpenFile& file);
+	void closeFile(OpenFile& file);
+	void trimFiles(bool opening = false);
+
+	std::string topDir;
+	Format format;
+	bool failed;
+	FILE* indexfd;
+	size_t maxOpen;
+	flat_table<FileInfo> pid_files;
+	flat_table<OpenFile> open_files;
+	CoreOutput cores[MaxCores];
+	std::string formatted;		// packet()'s samples
+};
+
+#endif // __SPLITTER_HPP_
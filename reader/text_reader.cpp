@@ -8,36 +8,178 @@
 #include <cstring>
 
 #include "../sender/packet.h"
+#include "../sender/csv_writer.h"
 
 #include "reader.hpp"
 
+// Everything goes to stdout through one large buffer, or when decoding in
+// parallel to the text of the chunk this thread is on, which chunk_end
+// then adds in turn.  Following a trace, each packet goes out as it's read.
+static csv_writer output(STDOUT_FILENO);
+static thread_local csv_writer* chunk_out;
+static bool live;
+
+static csv_writer& out() {
+	return chunk_out ? *chunk_out : output;
+}
+
+void chunk_begin(size_t chunk) {
+	static thread_local csv_writer text(-1);
+
+	(void)(chunk);
+	text.clear();
+	chunk_out = &text;
+}
+
+void chunk_end(size_t chunk) {
+	(void)(chunk);
+	if (chunk_out)
+		output.append(*chunk_out);
+	chunk_out = NULL;
+}
+
 void process_file(const char* fileName, const char* desc) {
-	printf("-- Description --\n%s\n-----------\n", desc);
+	output.print("-- Description --\n%s\n-----------\n", desc);
 }
 
 void process_packet(struct packet_header head,
 					const char* cmdline, const char* exe,
 					struct sample* samples) {
-	printf("== Krnl %u, #Ctrs %u, Core %u, Qty %u, Batch %u, Miss %u, 1st Idx %u, PID %u ==\n",
-		   head.kernel, head.counters, head.core, head.quantity,
-		   head.batch, head.missed, head.first_index, head.pid);
-	printf("<< cmd:  %s; exe:  %s >>\n", cmdline, exe);
+	csv_writer& f = out();
+
+	/* Weighted (rate capped) samples each stand for several */
+	if (head.weight != 1)
+		f.print("== Krnl %u, #Ctrs %u, Core %u, Qty %u, Batch %u, Miss %u, 1st Idx %u, PID %u, Weight %u ==\n",
+			   head.kernel, head.counters, head.core, head.quantity,
+			   head.batch, head.missed, head.first_index, head.pid, head.weight);
+	else
+		f.print("== Krnl %u, #Ctrs %u, Core %u, Qty %u, Batch %u, Miss %u, 1st Idx %u, PID %u ==\n",
+			   head.kernel, head.counters, head.core, head.quantity,
+			   head.batch, head.missed, head.first_index, head.pid);
+	f.print("<< cmd:  %s; exe:  %s >>\n", cmdline, exe);
 	for (size_t i=0; i<head.quantity; i++) {
-		struct sample c = samples[i];
-		printf("\t(%lu): %u,%u,%u,%u,%u,%u\n",
-			c.cycles,
-			c.counters[0], c.counters[1], c.counters[2],
-			c.counters[3], c.counters[4], c.counters[5]);
+		const struct sample& c = samples[i];
+		char* p = f.reserve(CSV_MAX_U64 + 6 * (CSV_MAX_U32 + 1) + 5);
+		*p++ = '\t';
+		*p++ = '(';
+		p = csv_u64(p, c.cycles);
+		*p++ = ')';
+		*p++ = ':';
+		*p++ = ' ';
+		p = csv_u32(p, c.counters[0]);
+		for (size_t j=1; j<6; j++) {
+			*p++ = ',';
+			p = csv_u32(p, c.counters[j]);
+		}
+		*p++ = '\n';
+		f.commit(p);
+	}
+	f.text("\n", 1);
+	if (live)
+		f.flush();
+}
+
+
+void process_aggregate(const struct packet_interval& interval,
+					const struct packet_aggregate* entries) {
+	csv_writer& f = out();
+
+	f.print("## Interval %u, Start %llu, Length %u ms, Miss %u, Entries %u ##\n",
+		   interval.number, (unsigned long long) interval.start_ms,
+		   interval.length_ms, interval.missed, interval.quantity);
+	for (size_t i=0; i<interval.quantity; i++) {
+		const struct packet_aggregate& e = entries[i];
+		f.print("\tPID %u, Core %u, Krnl %u, %u samples: %llu; %llu,%llu,%llu,%llu,%llu,%llu << %s; %s >>\n",
+			e.pid, e.core, e.kernel, e.samples, (unsigned long long) e.cycles,
+			(unsigned long long) e.sums[0], (unsigned long long) e.sums[1],
+			(unsigned long long) e.sums[2], (unsigned long long) e.sums[3],
+			(unsigned long long) e.sums[4], (unsigned long long) e.sums[5],
+			e.cmdline, e.exe);
 	}
-	printf("\n");
+	f.text("\n", 1);
+	if (live)
+		f.flush();
 }
 
 
+// Append a comma separated list of numbers to v
+template <typename T> static void parse_list(const char* list, std::vector<T>& v) {
+	char* end;
+	do {
+		v.push_back(strtoul(list, &end, 0));
+		list = end + 1;
+	} while (*end == ',');
+}
+
 int main(int argc, char** argv) {
-	if (argc != 2) {
-		printf("Usage: %s <data filename>\n", argv[0]);
+	struct read_filter filter;
+	bool follow = false;
+	bool filtered = false;
+	bool indexed = false;
+	int opt;
+
+	// -f follows a trace that is still being written; -j decodes on
+	// that many threads.  The rest pick packets:  by pids, cores
+	// (comma separated), kernel or user, batch and cycles (first[:last])
+	// and part of the exe; -x finds them through the trace's index.
+	while ((opt = getopt(argc, argv, "fj:p:c:k:b:t:e:x")) != -1) {
+		filtered |= strchr("fjx", opt) == NULL;
+		switch (opt) {
+			case 'f':
+				follow = true;
+				break;
+			case 'j':
+				reader_set_threads(atoi(optarg));
+				break;
+			case 'p':
+				parse_list(optarg, filter.pids);
+				break;
+			case 'c':
+				parse_list(optarg, filter.cores);
+				break;
+			case 'k':
+				filter.kernel = optarg[0] == 'k';
+				break;
+			case 'b': {
+				char* last;
+				filter.min_batch = strtoul(optarg, &last, 0);
+				filter.max_batch = *last == ':' ? strtoul(last + 1, NULL, 0) : filter.min_batch;
+				break;
+			}
+			case 't': {
+				char* last;
+				filter.min_cycles = strtoull(optarg, &last, 0);
+				filter.max_cycles = *last == ':' ? strtoull(last + 1, NULL, 0) : filter.min_cycles;
+				break;
+			}
+			case 'e':
+				filter.exe = optarg;
+				break;
+			case 'x':
+				indexed = true;
+				break;
+			default:
+				optind = argc + 1;
+		}
+	}
+	if (optind != argc - 1 || (follow && (filtered || indexed))) {
+		printf("Usage: %s [-f] [-j threads] [-p pids] [-c cores] [-k kernel|user]\n"
+			   "       [-b first[:last]] [-t first[:last]] [-e exe] [-x] <data filename>\n",
+			   argv[0]);
 		return 1;
 	}
 
-	return read_file(argv[1]);
-}
\ No newline at end of file
+	int rc;
+	live = follow;
+	if (indexed)
+		rc = read_range(argv[optind], filter);
+	else if (filtered)
+		rc = read_file(argv[optind], filter);
+	else
+		rc = follow ? follow_file(argv[optind]) : read_file(argv[optind]);
+	if (output.flush()) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(output.failed()));
+		return rc ? rc : 1;
+	}
+	return rc;
+}
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <cstring>
+
+#include "trace.hpp"
+
+// Where records' samples are decoded, and a count of the decodes so a
+// record can tell whether the samples there are still its own
+static thread_local struct sample decoded_samples[PACKET_MAX_SAMPLES];
+static thread_local unsigned long decodes;
+
+bool TraceRecord::decode() const {
+	if (decoded_ && decoded_ == decodes)
+		return good_;
+
+	struct packet_header head;
+	size_t pbytes;
+	char* cmdline;
+	char* exe;
+	int rc = packet_read(data_, size_, &head, decoded_samples, &cmdline, &exe, &pbytes);
+
+	decoded_ = ++decodes;
+	entries_ = NULL;
+	if (rc == 3)
+		entries_ = packet_aggregates(&interval_);
+	good_ = rc == (kind_ == Packet ? 0 : 3);
+	return good_;
+}
+
+const struct sample* TraceRecord::samples() const {
+	if (kind_ != Packet || !decode())
+		return NULL;
+	return decoded_samples;
+}
+
+const struct packet_interval& TraceRecord::interval() const {
+	if (!decode())
+		memset(&interval_, 0, sizeof(interval_));
+	return interval_;
+}
+
+const struct packet_aggregate* TraceRecord::aggregates() const {
+	return decode() ? entries_ : NULL;
+}
+
+int TraceCursor::next(TraceRecord& r, bool decode) {
+	while (position_ < size) {
+		uint8_t* at = data + position_;
+		size_t pbytes;
+		char* cmdline = NULL;
+		char* exe = NULL;
+		int rc;
+
+		if (decode)
+			rc = packet_read(at, size - position_, &r.head_, decoded_samples,
+							 &cmdline, &exe, &pbytes);
+		else
+			rc = packet_peek(at, size - position_, &r.head_, &cmdline, &exe, &pbytes);
+		if (rc == 1)
+			return 0;
+		if (rc < 0)
+			return -1;
+
+		position_ += pbytes;
+		if (rc == 2)
+			continue;	// Process record; the table has it now
+
+		r.kind_ = rc == 3 ? TraceRecord::Aggregate : TraceRecord::Packet;
+		r.data_ = at;
+		r.size_ = pbytes;
+		r.offset_ = offset + (at - data);
+		r.cmdline_ = cmdline;
+		r.exe_ = exe;
+		r.decoded_ = 0;
+		if (decode) {
+			r.decoded_ = ++decodes;
+			r.good_ = true;
+			r.entries_ = rc == 3 ? packet_aggregates(&r.interval_) : NULL;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+Trace::Trace() : map(NULL), length(0), body(0), cursor(NULL, 0, 0), status_(0) { }
+
+Trace::~Trace() {
+	if (map)
+		munmap(map, length);
+}
+
+int Trace::open(const char* fileName) {
+	struct stat info;
+	int fd = ::open(fileName, O_RDONLY);
+
+	if (fd == -1) {
+		perror("Error opening file for reading");
+		return -1;
+	}
+	if (fstat(fd, &info) || info.st_size == 0) {
+		fprintf(stderr, "Error reading description: no end in %s\n", fileName);
+		close(fd);
+		return -1;
+	}
+	void* mem = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("Error mmapping file");
+		return -1;
+	}
+	madvise(mem, info.st_size, MADV_SEQUENTIAL);
+
+	uint8_t* end = (uint8_t*) memchr(mem, '\0', info.st_size);
+	if (end == NULL) {
+		fprintf(stderr, "Error reading description: no end in %s\n", fileName);
+		munmap(mem, info.st_size);
+		return -1;
+	}
+	if (map)
+		munmap(map, length);
+	map = (uint8_t*) mem;
+	length = info.st_size;
+	body = end - map + 1;
+	packet_set_format(packet_parse_format((const char*) map));
+	return 0;
+}
+
+Trace::iterator Trace::begin() {
+	cursor = TraceCursor(map + body, length - body, body);
+	status_ = 0;
+	return map ? iterator(this) : end();
+}
+
+void Trace::iterator::advance() {
+	int rc = trace->cursor.next(record);
+	if (rc <= 0) {
+		if (rc < 0)
+			trace->status_ = -1;
+		else if (trace->cursor.position() < trace->length - trace->body)
+			trace->status_ = 1;
+		trace = NULL;
+	}
+}
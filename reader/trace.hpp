@@ -0,0 +1,165 @@
+#ifndef __TRACE_HPP_
+#define __TRACE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../sender/packet.h"
+
+// A record of a trace seen where it lies:  a view of its bytes with the
+// header decoded, and the samples decoded only once they are asked for.
+// Process records never show up; they are taken in as they go by.
+class TraceRecord {
+public:
+	enum Kind {
+		Packet,
+		Aggregate
+	};
+
+	TraceRecord() : data_(NULL), size_(0), offset_(0), decoded_(0), good_(false) { }
+
+	Kind kind() const { return kind_; }
+	const uint8_t* data() const { return data_; }
+	size_t size() const { return size_; }
+	uint64_t offset() const { return offset_; }	// In the file
+
+	// Packets:  the header, cmdline and exe packet_read would give, that
+	// is of the first sample's process
+	const struct packet_header& header() const { return head_; }
+	const char* cmdline() const { return cmdline_; }
+	const char* exe() const { return exe_; }
+
+	// Packets:  the samples, decoded on the first call.  Good until
+	// another record's samples are decoded on this thread.  NULL if the
+	// packet turns out to be malformed.
+	const struct sample* samples() const;
+
+	// Packets:  f(run, cmdline, exe, samples) for each single-process run,
+	// as read_file hands them to process_packet.  Returns 0, or -1 if the
+	// packet is malformed.
+	template <typename F> int forEachRun(F f) const;
+
+	// Aggregate records, decoded on the first call of either; good as
+	// samples() is.  NULL entries if malformed.
+	const struct packet_interval& interval() const;
+	const struct packet_aggregate* aggregates() const;
+
+private:
+	friend class TraceCursor;
+
+	bool decode() const;
+
+	Kind kind_;
+	uint8_t* data_;
+	size_t size_;
+	uint64_t offset_;
+	struct packet_header head_;
+	const char* cmdline_;
+	const char* exe_;
+
+	// Which decode on this thread the samples or aggregates came from
+	mutable unsigned long decoded_;
+	mutable bool good_;
+	mutable struct packet_interval interval_;
+	mutable const struct packet_aggregate* entries_;
+};
+
+// Hands out the records in data[0, size), offset being where data lies in
+// the file.  The format must be set (packet_set_format) beforehand.
+class TraceCursor {
+public:
+	TraceCursor(uint8_t* data, size_t size, uint64_t offset) :
+		data(data), size(size), offset(offset), position_(0) { }
+
+	// The next record into r:  1, or 0 at the end (or at a record that
+	// isn't all there), -1 on malformed data.  With decode, the samples
+	// are read right away, in the same pass.
+	int next(TraceRecord& r, bool decode = false);
+
+	// Bytes of data the records handed out so far take up
+	size_t position() const { return position_; }
+
+private:
+	uint8_t* data;
+	size_t size;
+	uint64_t offset;
+	size_t position_;
+};
+
+// A whole trace file, mapped, walked with an iterator:
+//
+//	Trace trace;
+//	if (trace.open(fileName))
+//		return 1;
+//	for (const TraceRecord& r : trace)
+//		if (r.kind() == TraceRecord::Packet && r.header().pid == pid)
+//			use(r.samples(), r.header().quantity);
+//
+// Records are views into the mapping and stay good as long as the Trace.
+// Like read_file, open sets the packet format, so walk one trace at a
+// time.  Needs room for the whole file in the address space; read_file
+// works through a window instead.
+class Trace {
+public:
+	class iterator {
+	public:
+		iterator() : trace(NULL) { }
+
+		const TraceRecord& operator*() const { return record; }
+		const TraceRecord* operator->() const { return &record; }
+		iterator& operator++() { advance(); return *this; }
+		bool operator==(const iterator& o) const { return trace == o.trace; }
+		bool operator!=(const iterator& o) const { return trace != o.trace; }
+
+	private:
+		friend class Trace;
+		iterator(Trace* trace) : trace(trace) { advance(); }
+		void advance();
+
+		Trace* trace;		// NULL at the end
+		TraceRecord record;
+	};
+
+	Trace();
+	~Trace();
+
+	// Map fileName and read its description.  Returns 0, or -1 with a
+	// message on stderr.
+	int open(const char* fileName);
+	const char* description() const { return (const char*) map; }
+
+	// Start again from the first record
+	iterator begin();
+	iterator end() { return iterator(); }
+
+	// Once the walk has ended:  -1 if on malformed data, 1 if on a record
+	// cut short, 0 if at the end of the file
+	int status() const { return status_; }
+
+private:
+	Trace(const Trace&);
+	Trace& operator=(const Trace&);
+
+	uint8_t* map;
+	size_t length;
+	size_t body;		// Where the records start
+	TraceCursor cursor;
+	int status_;
+};
+
+template <typename F> int TraceRecord::forEachRun(F f) const {
+	struct sample* all = (struct sample*) samples();
+	if (all == NULL)
+		return -1;
+
+	for (size_t at = 0; at < head_.quantity; ) {
+		struct packet_header run;
+		char* cmdline;
+		char* exe;
+		at += packet_run(&head_, at, &run, &cmdline, &exe);
+		f(run, cmdline, exe, all + at - run.quantity);
+	}
+	return 0;
+}
+
+#endif // __TRACE_HPP_
@@ -0,0 +1,148 @@
+
+#include <string.h>
+#include <time.h>
+
+#include "aggregate.h"
+#include "flat_table.h"
+#include "stats.h"
+
+/* Two 64-bit lanes; SSE2 or NEON adds wherever the compiler has them */
+typedef uint64_t lanes __attribute__((vector_size(16)));
+
+struct accumulator {
+	uint32_t samples;
+	uint64_t cycles;
+	uint64_t sums[6];
+};
+
+/*
+ * Add two counters into sum[0] and sum[1].  Accumulators live in
+ * flat_table blocks from plain new, which only promises 8 byte alignment
+ * on some targets, so the lanes are moved in and out with memcpy (an
+ * unaligned load and store) rather than kept there.
+ */
+static inline void add_lanes(uint64_t *sum, lanes add)
+{
+	lanes v;
+
+	memcpy(&v, sum, sizeof(v));
+	v += add;
+	memcpy(sum, &v, sizeof(v));
+}
+
+static struct {
+	unsigned ms;
+	int on_demand;		/* Only some buffers are folded */
+	uint32_t number;
+	uint64_t opened;	/* stats_now() when the interval began */
+	uint64_t start_ms;	/* ... and the wall clock */
+	uint8_t counters;
+
+	/* Keyed by core << 24 | pid; pids never reach 2^22 */
+	flat_table<struct accumulator> *table;
+} ag;
+
+static uint64_t wall_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void open_interval()
+{
+	ag.opened = stats_now();
+	ag.start_ms = wall_ms();
+}
+
+void aggregate_set(unsigned ms)
+{
+	ag.ms = ms;
+	ag.on_demand = 0;
+	ag.number = 0;
+	if (!ag.table)
+		ag.table = new flat_table<struct accumulator>();
+	ag.table->clear();
+	open_interval();
+}
+
+int aggregate_enabled()
+{
+	return ag.ms != 0 && !ag.on_demand;
+}
+
+void aggregate_on_demand(unsigned ms)
+{
+	aggregate_set(ms);
+	ag.on_demand = 1;
+}
+
+int aggregate_pending()
+{
+	return ag.table && ag.table->size() != 0;
+}
+
+int aggregate_due()
+{
+	return stats_now() - ag.opened >= (uint64_t)(ag.ms) * 1000000;
+}
+
+void aggregate_fold(struct buffer &b, void (*new_pid)(uint32_t pid))
+{
+	uint32_t core = (b.core & 0xff) << 24;
+	unsigned i = 0;
+
+	if (ag.on_demand && !ag.table->size())
+		open_interval();
+	for (i = 0; i < b.num_samples; ++i) {
+		const struct sample &s = b.samples[i];
+		uint32_t key = core | (uint32_t)(s.pid);
+		struct accumulator *a = ag.table->find(key);
+		lanes c01 = { s.counters[0], s.counters[1] };
+		lanes c23 = { s.counters[2], s.counters[3] };
+		lanes c45 = { s.counters[4], s.counters[5] };
+
+		if (!a) {
+			a = &(*ag.table)[key];
+			memset(a, 0, sizeof(*a));
+			new_pid((uint32_t)(s.pid));
+		}
+		++a->samples;
+		a->cycles += s.cycles;
+		add_lanes(&a->sums[0], c01);
+		add_lanes(&a->sums[2], c23);
+		add_lanes(&a->sums[4], c45);
+	}
+}
+
+size_t aggregate_take(struct packet_interval *iv, std::vector<struct packet_aggregate> &out)
+{
+	uint64_t now = stats_now();
+
+	iv->number = ag.number++;
+	iv->start_ms = ag.start_ms;
+	iv->length_ms = (uint32_t)((now - ag.opened) / 1000000);
+	iv->missed = 0;
+	iv->counters = PACKET_MAX_COUNTERS;	/* packet_aggregate_record trims these */
+
+	out.clear();
+	ag.table->for_each([&out](uint32_t key, struct accumulator &a) {
+		struct packet_aggregate e;
+		int c = 0;
+
+		memset(&e, 0, sizeof(e));
+		e.pid = key & 0xffffff;
+		e.core = (uint8_t)(key >> 24);
+		e.samples = a.samples;
+		e.cycles = a.cycles;
+		for (c = 0; c < 6; ++c)
+			e.sums[c] = a.sums[c];
+		out.push_back(e);
+	});
+	iv->quantity = out.size();
+
+	ag.table->clear();
+	open_interval();
+	return out.size();
+}
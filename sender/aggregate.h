@@ -0,0 +1,52 @@
+
+#ifndef ANDROID_ARM_PROJECT_AGGREGATE_H
+#define ANDROID_ARM_PROJECT_AGGREGATE_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "packet.h"
+#include "sample_buffer.h"
+
+/*
+ * Pre-aggregation (--aggregate <ms>).  Instead of samples the sender
+ * keeps, for every pid and core, the number of samples and the sums of
+ * their cycles and counters, and sends them as one aggregate record per
+ * interval.  That is enough for per-process IPC and miss rates at a tiny
+ * fraction of the bytes.
+ *
+ * Only the encoder calls these.
+ */
+
+/* Turn aggregation on with intervals of ms milliseconds (0 is off). */
+void aggregate_set(unsigned ms);
+int aggregate_enabled();
+
+/*
+ * Intervals of ms milliseconds for folding only some buffers (the
+ * aggregate policy of --rate); aggregate_enabled() stays false.  Each
+ * interval then starts with its first fold.
+ */
+void aggregate_on_demand(unsigned ms);
+
+/* Whether the interval has any samples in it */
+int aggregate_pending();
+
+/* Whether the interval is over and should be taken before the next fold */
+int aggregate_due();
+
+/*
+ * Add every sample of b to its accumulator.  new_pid(pid) is called
+ * the first time a pid turns up in an interval.
+ */
+void aggregate_fold(struct buffer &b, void (*new_pid)(uint32_t pid));
+
+/*
+ * End the interval:  fill in *iv (but its missed count) and move its
+ * entries into out (pid, core and sums; not ids or kernel flags), then
+ * start the next one.  Returns the number of entries.
+ */
+size_t aggregate_take(struct packet_interval *iv, std::vector<struct packet_aggregate> &out);
+
+#endif
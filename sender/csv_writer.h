@@ -0,0 +1,220 @@
+#ifndef ANDROID_ARM_PROJECT_CSV_WRITER_H
+#define ANDROID_ARM_PROJECT_CSV_WRITER_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Text output for the trace tools.  Numbers are turned into digits by
+ * hand, two at a time from a table, instead of going through printf's
+ * format parsing for every field.  They go straight into a large buffer,
+ * which goes out with one write() whenever it fills.
+ *
+ * The hot path works on raw pointers:  reserve() room for a line, put
+ * the fields with csv_u32/csv_u64/csv_text, then commit() the end.
+ *
+ *	char *p = out.reserve(CSV_MAX_U64 + 1);
+ *	p = csv_u64(p, cycles);
+ *	*p++ = '\n';
+ *	out.commit(p);
+ *
+ * A writer on fd -1 keeps everything in memory (growing as needed) until
+ * it is handed to another writer with append(), for output put together
+ * out of order.
+ */
+
+/* Most characters csv_u32 and csv_u64 write */
+#define CSV_MAX_U32 (10)
+#define CSV_MAX_U64 (20)
+
+static const char csv_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+template <typename T>
+static inline unsigned csv_digits(T v)
+{
+	unsigned n = 1;
+
+	for (;;) {
+		if (v < 10)
+			return n;
+		if (v < 100)
+			return n + 1;
+		if (v < 1000)
+			return n + 2;
+		if (v < 10000)
+			return n + 3;
+		v /= 10000;
+		n += 4;
+	}
+}
+
+/* Write v in decimal at p; returns the end */
+template <typename T>
+static inline char *csv_number(char *p, T v)
+{
+	char *end = p + csv_digits(v);
+
+	p = end;
+	while (v >= 100) {
+		unsigned i = (unsigned)(v % 100) * 2;
+
+		v /= 100;
+		p -= 2;
+		memcpy(p, csv_pairs + i, 2);
+	}
+	if (v >= 10)
+		memcpy(p - 2, csv_pairs + (unsigned)(v) * 2, 2);
+	else
+		p[-1] = '0' + (char)(v);
+	return end;
+}
+
+static inline char *csv_u32(char *p, uint32_t v)
+{
+	return csv_number(p, v);
+}
+
+static inline char *csv_u64(char *p, uint64_t v)
+{
+	return csv_number(p, v);
+}
+
+static inline char *csv_text(char *p, const char *s, size_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+class csv_writer {
+	int fd;
+	char *buf;
+	size_t cap;
+	size_t len;
+	int error;		/* errno of the first failed write */
+
+	int grow(size_t need)
+	{
+		size_t bigger = cap;
+		char *mem = NULL;
+
+		while (bigger - len < need)
+			bigger *= 2;
+		mem = (char *)(realloc(buf, bigger));
+		if (!mem)
+			return -1;
+		buf = mem;
+		cap = bigger;
+		return 0;
+	}
+
+public:
+	explicit csv_writer(int fd, size_t size = 1 << 20) :
+		fd(fd), buf((char *)(malloc(size))), cap(buf ? size : 0), len(0), error(0) { }
+
+	~csv_writer()
+	{
+		flush();
+		free(buf);
+	}
+
+	/* Room for n more bytes, at the returned pointer */
+	char *reserve(size_t n)
+	{
+		if (cap - len < n) {
+			if (fd >= 0)
+				flush();
+			if (cap - len < n && grow(n))
+				abort();
+		}
+		return buf + len;
+	}
+
+	/* Take in what was put between reserve() and end */
+	void commit(char *end)
+	{
+		len = end - buf;
+	}
+
+	void text(const char *s, size_t n)
+	{
+		commit(csv_text(reserve(n), s, n));
+	}
+
+	void text(const char *s)
+	{
+		text(s, strlen(s));
+	}
+
+	void append(const csv_writer &other)
+	{
+		text(other.buf, other.len);
+	}
+
+	/* For the odd line not worth putting together by hand */
+	void print(const char *fmt, ...) __attribute__((format(printf, 2, 3)))
+	{
+		va_list args;
+		int n = 0;
+
+		va_start(args, fmt);
+		n = vsnprintf(buf + len, cap - len, fmt, args);
+		va_end(args);
+		if (n >= 0 && (size_t)(n) >= cap - len) {
+			reserve(n + 1);
+			va_start(args, fmt);
+			vsnprintf(buf + len, cap - len, fmt, args);
+			va_end(args);
+		}
+		if (n > 0)
+			len += n;
+	}
+
+	/* Drop what is buffered (for a writer on fd -1) */
+	void clear()
+	{
+		len = 0;
+	}
+
+	/* Write out what is buffered.  Returns 0, or -1 once a write fails. */
+	int flush()
+	{
+		size_t done = 0;
+
+		while (fd >= 0 && done < len && !error) {
+			ssize_t rc = write(fd, buf + done, len - done);
+			if (rc < 0 && errno != EINTR)
+				error = errno;
+			else if (rc > 0)
+				done += rc;
+		}
+		if (fd >= 0)
+			len = 0;
+		return error ? -1 : 0;
+	}
+
+	int failed() const
+	{
+		return error;
+	}
+
+private:
+	csv_writer(const csv_writer &);
+	csv_writer &operator=(const csv_writer &);
+};
+
+#endif
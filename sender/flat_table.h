@@ -0,0 +1,379 @@
+
+#ifndef ANDROID_ARM_PROJECT_FLAT_TABLE_H
+#define ANDROID_ARM_PROJECT_FLAT_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Open-addressing hash table keyed by a 32-bit id (a pid, usually).
+ *
+ * Values live in fixed blocks and never move, so a pointer or reference
+ * stays good until its key is erased or evicted.  The index over them is
+ * linear probing with backward-shift deletion, so there are no
+ * tombstones to clean up.  The last key looked up is remembered, since
+ * consecutive samples are nearly always from the same pid.
+ *
+ * A table with a limit never evicts on its own; inserts always succeed.
+ * Call trim() where nothing holds on to entries (between batches) to
+ * evict down to the limit, least recently used first by the CLOCK
+ * algorithm.  A limit of 0 means grow forever.
+ */
+template <typename V>
+class flat_table {
+	enum {
+		BLOCK = 1024,		/* Entries per block */
+		EMPTY = 0xffffffffU	/* Free index slot */
+	};
+
+	struct entry {
+		uint32_t key;
+		uint8_t used;
+		uint8_t referenced;	/* Looked up since the hand last passed */
+		V value;
+	};
+
+	std::vector<entry *> blocks;
+	std::vector<uint32_t> index;		/* Entry numbers */
+	std::vector<uint32_t> free_entries;
+	uint32_t entries;			/* Entry numbers handed out so far */
+	size_t count;
+	size_t limit;
+	uint32_t hand;				/* CLOCK position */
+	unsigned shift;				/* 32 - log2(index size) */
+
+	entry *last;
+	uint32_t last_key;
+
+	entry &at(uint32_t n)
+	{
+		return blocks[n / BLOCK][n % BLOCK];
+	}
+
+	size_t home(uint32_t key) const
+	{
+		return (uint32_t)(key * 2654435761U) >> shift;
+	}
+
+	/* Index slot holding key, or the empty slot where it would go */
+	size_t probe(uint32_t key)
+	{
+		size_t mask = index.size() - 1;
+		size_t i = home(key);
+
+		while (index[i] != EMPTY && at(index[i]).key != key)
+			i = (i + 1) & mask;
+		return i;
+	}
+
+	void resize_index(size_t slots)
+	{
+		size_t n = 16;
+		unsigned bits = 4;
+		uint32_t e = 0;
+
+		while (n < slots) {
+			n <<= 1;
+			++bits;
+		}
+		index.assign(n, EMPTY);
+		shift = 32 - bits;
+		for (e = 0; e < entries; ++e) {
+			if (at(e).used)
+				index[probe(at(e).key)] = e;
+		}
+	}
+
+	uint32_t new_entry()
+	{
+		uint32_t n = 0;
+
+		if (!free_entries.empty()) {
+			n = free_entries.back();
+			free_entries.pop_back();
+			return n;
+		}
+		if (entries % BLOCK == 0)
+			blocks.push_back(new entry[BLOCK]());
+		return entries++;
+	}
+
+	void remove_slot(size_t i)
+	{
+		size_t mask = index.size() - 1;
+		size_t j = i;
+		entry &e = at(index[i]);
+
+		if (&e == last)
+			last = NULL;
+		e.used = 0;
+		e.referenced = 0;
+		e.value = V();
+		free_entries.push_back(index[i]);
+		--count;
+
+		/* Pull later members of the cluster back over the hole */
+		for (;;) {
+			size_t k = 0;
+
+			j = (j + 1) & mask;
+			if (index[j] == EMPTY)
+				break;
+			k = home(at(index[j]).key);
+			if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+				index[i] = index[j];
+				i = j;
+			}
+		}
+		index[i] = EMPTY;
+	}
+
+public:
+	explicit flat_table(size_t limit = 0) :
+		entries(0), count(0), limit(limit), hand(0), shift(0),
+		last(NULL), last_key(0)
+	{
+		/* A bounded table only overshoots by a batch, so size it once */
+		resize_index(limit ? 2 * (limit + BLOCK) : 16);
+	}
+
+	~flat_table()
+	{
+		size_t b = 0;
+
+		for (b = 0; b < blocks.size(); ++b)
+			delete [] blocks[b];
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	/* Look key up without inserting; NULL if absent. */
+	V *find(uint32_t key)
+	{
+		size_t i = 0;
+
+		if (last && last_key == key) {
+			last->referenced = 1;
+			return &last->value;
+		}
+		i = probe(key);
+		if (index[i] == EMPTY)
+			return NULL;
+		last = &at(index[i]);
+		last_key = key;
+		last->referenced = 1;
+		return &last->value;
+	}
+
+	/* Like find(), but doesn't count as a use. */
+	V *peek(uint32_t key)
+	{
+		size_t i = probe(key);
+
+		return index[i] == EMPTY ? NULL : &at(index[i]).value;
+	}
+
+	/* Find key, inserting a default value if it is new. */
+	V &operator[](uint32_t key)
+	{
+		V *v = find(key);
+		size_t i = 0;
+		uint32_t n = 0;
+
+		if (v)
+			return *v;
+
+		if (2 * (count + 1) > index.size())
+			resize_index(4 * (count + 1));
+		i = probe(key);
+		n = new_entry();
+		index[i] = n;
+		at(n).key = key;
+		at(n).used = 1;
+		at(n).referenced = 1;
+		++count;
+
+		last = &at(n);
+		last_key = key;
+		return last->value;
+	}
+
+	/* Clear key's recently-used bit, returning what it was. */
+	int age(uint32_t key)
+	{
+		size_t i = probe(key);
+		int was = 0;
+
+		if (index[i] == EMPTY)
+			return 0;
+		was = at(index[i]).referenced;
+		at(index[i]).referenced = 0;
+		return was;
+	}
+
+	int erase(uint32_t key)
+	{
+		size_t i = probe(key);
+
+		if (index[i] == EMPTY)
+			return 0;
+		remove_slot(i);
+		return 1;
+	}
+
+	/*
+	 * Evict down to the limit.  gone(key, value) is called for each
+	 * victim just before it is erased.  Returns how many went.
+	 */
+	template <typename F>
+	size_t trim(F gone)
+	{
+		return limit ? trim(gone, limit) : 0;
+	}
+
+	/* The same, down to n entries whatever the limit */
+	template <typename F>
+	size_t trim(F gone, size_t n)
+	{
+		size_t evicted = 0;
+
+		while (count > n) {
+			entry &e = at(hand);
+
+			hand = (hand + 1) % entries;
+			if (!e.used)
+				continue;
+			if (e.referenced) {
+				e.referenced = 0;
+				continue;
+			}
+			gone(e.key, e.value);
+			remove_slot(probe(e.key));
+			++evicted;
+		}
+		return evicted;
+	}
+
+	/* f(key, value) for every entry, in no particular order */
+	template <typename F>
+	void for_each(F f)
+	{
+		uint32_t e = 0;
+
+		for (e = 0; e < entries; ++e) {
+			if (at(e).used)
+				f(at(e).key, at(e).value);
+		}
+	}
+
+	void clear()
+	{
+		uint32_t e = 0;
+
+		for (e = 0; e < entries; ++e) {
+			at(e).used = 0;
+			at(e).referenced = 0;
+			at(e).value = V();
+		}
+		free_entries.clear();
+		for (e = entries; e > 0; --e)
+			free_entries.push_back(e - 1);
+		index.assign(index.size(), EMPTY);
+		count = 0;
+		hand = 0;
+		last = NULL;
+	}
+};
+
+/*
+ * NUL terminated strings packed into large chunks, for tables that would
+ * otherwise hold two heap strings per entry.  Space is only given back by
+ * compacting:  when fragmented() says most of it is dead, copy the live
+ * strings into a fresh arena and swap() it in.
+ */
+class string_arena {
+	enum { CHUNK = 64 * 1024 };
+
+	std::vector<char *> chunks;
+	char *cur;
+	size_t left;		/* Bytes free at cur */
+	size_t total;		/* Bytes handed out */
+	size_t live;		/* Of which not yet released */
+
+public:
+	string_arena() : cur(NULL), left(0), total(0), live(0) { }
+
+	~string_arena()
+	{
+		size_t c = 0;
+
+		for (c = 0; c < chunks.size(); ++c)
+			free(chunks[c]);
+	}
+
+	/* Copy s in.  Empty strings are never stored. */
+	const char *store(const char *s)
+	{
+		size_t n = strlen(s) + 1;
+		char *p = NULL;
+
+		if (n == 1)
+			return "";
+
+		if (n > left) {
+			/* Big ones get a chunk to themselves */
+			size_t size = n > CHUNK / 4 ? n : (size_t)(CHUNK);
+
+			p = (char *)(malloc(size));
+			if (!p)
+				return "";
+			chunks.push_back(p);
+			if (size == CHUNK) {
+				cur = p;
+				left = CHUNK;
+			}
+		}
+		if (n <= left) {
+			p = cur;
+			cur += n;
+			left -= n;
+		}
+		memcpy(p, s, n);
+		total += n;
+		live += n;
+		return p;
+	}
+
+	void release(const char *s)
+	{
+		if (*s)
+			live -= strlen(s) + 1;
+	}
+
+	int fragmented() const
+	{
+		return total > CHUNK && total > 2 * live;
+	}
+
+	void swap(string_arena &other)
+	{
+		std::swap(chunks, other.chunks);
+		std::swap(cur, other.cur);
+		std::swap(left, other.left);
+		std::swap(total, other.total);
+		std::swap(live, other.live);
+	}
+
+private:
+	string_arena(const string_arena &);
+	string_arena &operator=(const string_arena &);
+};
+
+#endif
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -7,52 +8,269 @@
 #include <string.h>
 #include <error.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "aggregate.h"
+#include "network.h"
 #include "packet.h"
 #include "process_info.h"
+#include "spool.h"
+#include "stats.h"
+#include "throttle.h"
 
 static int the_socket = 0;
 static struct addrinfo *addr = NULL;
-static int transmit(size_t *sent);
+static int transmit(packet_sink sink, void *arg, size_t *sent);
+static int direct_sink(void *packet, size_t bytes, size_t *sent, void *arg);
 static int debug = 0;
+static int spooling = 0;
+
+/* Bytes handed to sinks so far:  where in the stream a record ends */
+static uint64_t encoded = 0;
 
 static FILE *network_debug = NULL;
 
-int network_send(struct buffer &b, uint32_t missed, size_t *total)
+/* Local output (-o): large aligned writes instead of a socket */
+#define OUTPUT_ALIGN (4096)
+#define OUTPUT_BUFFER (1024 * 1024)
+
+static struct {
+	int fd;
+	int direct;
+	int close;
+	char *buf;
+	size_t len;
+} output = { -1, 0, 0, NULL, 0 };
+
+/* How long network_finish() lets the spool catch up */
+#define SPOOL_DRAIN_MS (10000)
+
+static int output_write(const void *data, size_t bytes);
+static int output_flush(int final);
+
+/* --aggregate:  the interval being handed out */
+static std::vector<struct packet_aggregate> aggregates;
+
+/* Samples lost so far on each core (as packet headers carry them) and on all */
+#define LOST_CORES (256)
+static struct {
+	uint32_t core[LOST_CORES];
+	uint8_t seen[LOST_CORES];
+	uint32_t total;
+} lost;
+
+int network_send(struct buffer &b, uint32_t dropped, size_t *total)
+{
+	return network_encode(b, dropped, direct_sink, NULL, total);
+}
+
+/*
+ * Add up what was lost on b's core since its previous buffer:  what
+ * the module noted in b and what the caller dropped.  The first buffer
+ * of a core may carry losses from before anyone was reading; skip them.
+ */
+static uint32_t count_lost(struct buffer &b, uint32_t n)
+{
+	uint8_t core = (uint8_t)(b.core);
+
+	if (lost.seen[core])
+		n += b.missed;
+	lost.seen[core] = 1;
+	lost.core[core] += n;
+	lost.total += n;
+	return lost.core[core];
+}
+
+/* Hand data to sink, keeping count of the stream */
+static int emit(packet_sink sink, void *arg, void *data, size_t bytes, size_t *sent)
+{
+	encoded += bytes;
+	return sink(data, bytes, sent, arg);
+}
+
+/* Send pi's process record if the reader hasn't got this generation of it */
+static int announce(struct ProcessInfo &pi, packet_sink sink, void *arg, size_t *sent_total)
+{
+	size_t sent = 0;
+	void *record = NULL;
+	size_t record_bytes = 0;
+
+	if (packet_process_record(pi, &record, &record_bytes))
+		return -1;
+	if (!record)
+		return 0;
+	if (spooling)
+		spool_record(pi.wire.id, record, record_bytes);
+	if (emit(sink, arg, record, record_bytes, &sent))
+		return -1;
+	*sent_total += sent;
+	return 0;
+}
+
+/* Tell the reader which ids it can drop; every packet using them is out */
+static int send_retired(packet_sink sink, void *arg, size_t *sent_total)
+{
+	size_t sent = 0;
+	void *record = NULL;
+	size_t record_bytes = 0;
+	const uint32_t *ids = NULL;
+	size_t n = 0;
+	size_t i = 0;
+
+	if (packet_retire_record(&record, &record_bytes))
+		return -1;
+	if (!record)
+		return 0;
+	/* Reconnects must bring the ids back until the record has gone out */
+	n = packet_retired(&ids);
+	for (i = 0; spooling && i < n; ++i)
+		spool_retire(ids[i], encoded + record_bytes);
+	if (emit(sink, arg, record, record_bytes, &sent))
+		return -1;
+	*sent_total += sent;
+	return 0;
+}
+
+/* Add s to the current packet, announcing its process and sending the packet first as needed */
+static int encode_sample(struct buffer &b, struct sample &s, struct ProcessInfo &pi,
+    uint32_t missed, packet_sink sink, void *arg, size_t *sent_total)
+{
+	size_t sent = 0;
+
+	/* Tell the reader about the process before it sees its samples */
+	if (announce(pi, sink, arg, sent_total))
+		return -1;
+
+	if (packet_should_create(b, s, pi)) {
+		if (debug)
+			fprintf(stderr, "PACKET MUST BE SENT BEFORE CONTINUING.\n");
+		if (transmit(sink, arg, &sent))
+			return -1;
+		*sent_total += sent;
+	}
+
+	/* This should never happen given the above statement */
+	return packet_append(b, s, pi, missed);
+}
+
+/* Start resolving a pid as soon as it shows up in an interval */
+static void aggregate_new_pid(uint32_t pid)
+{
+	getProcessInfo(pid, packet_can_refresh(pid));
+}
+
+/* End the aggregation interval and send its record, processes first */
+static int send_aggregates(packet_sink sink, void *arg, size_t *sent_total)
 {
+	struct packet_interval iv;
+	void *record = NULL;
+	size_t bytes = 0;
+	size_t sent = 0;
+	size_t i = 0;
+
+	if (!aggregate_take(&iv, aggregates))
+		return 0;
+	iv.missed = lost.total;
+	for (i = 0; i < aggregates.size(); ++i) {
+		struct ProcessInfo& pi = getProcessInfo(aggregates[i].pid, 0);
+
+		if (announce(pi, sink, arg, sent_total))
+			return -1;
+		aggregates[i].id = pi.wire.id;
+		aggregates[i].kernel = (pi.mode == ProcessInfo::Kernel) ? 1 : 0;
+	}
+	if (packet_aggregate_record(&iv, &aggregates[0], aggregates.size(), &record, &bytes))
+		return -1;
+	if (emit(sink, arg, record, bytes, &sent))
+		return -1;
+	*sent_total += sent;
+	return 0;
+}
+
+int network_encode(struct buffer &b, uint32_t dropped, packet_sink sink, void *arg,
+    size_t *total)
+{
+	uint32_t missed = count_lost(b, dropped);
 	size_t sent = 0;
 	size_t sent_total = 0;
 	size_t index = 0;
-	void *data = NULL;
+	uint64_t started = stats_now();
+	int throttled = throttle_enabled();
+	uint32_t weight = 1;
 
 	assert(b.num_samples <= BUFFER_ENTRIES);
 
 	if (debug)
 		fprintf(stderr, "STARTING BATCH WITH %u SAMPLES!\n", b.num_samples);
 
+	if (total)
+		*total = 0;
+	process_info_update();
 	packet_start_batch();
-	for (index = 0; index < b.num_samples; ++index) {
-		struct sample &s = b.samples[index];
-		struct ProcessInfo& pi = getProcessInfo(s.pid, packet_empty());
-
-		if (packet_should_create(b, s, pi)) {
-			if (debug)
-				fprintf(stderr, "PACKET MUST BE SENT BEFORE CONTINUING.\n");
-			if (transmit(&sent))
-				return -1;
-			sent_total += sent;
+	if (send_retired(sink, arg, &sent_total))
+		return -1;
+
+	/* Samples only go into the interval's sums */
+	if (aggregate_enabled()) {
+		if (aggregate_due() && send_aggregates(sink, arg, &sent_total))
+			return -1;
+		aggregate_fold(b, aggregate_new_pid);
+		stats_add(STAT_SAMPLES, b.num_samples);
+		if (b.num_samples)
+			stats_time(STAT_ENCODE_NS, (stats_now() - started) / b.num_samples);
+		if (total)
+			*total = sent_total;
+		return 0;
+	}
+
+	if (throttled && throttle_start(b)) {
+		lost.core[(uint8_t)(b.core)] += b.num_samples;
+		lost.total += b.num_samples;
+		if (total)
+			*total = sent_total;
+		return 0;
+	}
+
+	/* --rate's aggregate policy:  sums while over the rate, packets otherwise */
+	if (throttled && (throttle_folding() || aggregate_pending())) {
+		if (aggregate_pending() && (!throttle_folding() || aggregate_due()) &&
+		    send_aggregates(sink, arg, &sent_total))
+			return -1;
+		if (throttle_folding()) {
+			aggregate_fold(b, aggregate_new_pid);
+			throttle_spent(sent_total);
+			stats_add(STAT_SAMPLES, b.num_samples);
+			if (total)
+				*total = sent_total;
+			return 0;
 		}
+	}
 
-		/* This should never happen given the above statement */
-		if (packet_append(b, s, pi, missed))
+	for (index = 0; index < b.num_samples; ++index) {
+		struct sample *s = &b.samples[index];
+		struct ProcessInfo& pi = getProcessInfo(s->pid, packet_can_refresh(s->pid));
+
+		if (throttled) {
+			s = throttle_sample(*s, pi, &weight);
+			if (!s)
+				continue;
+			packet_set_weight(weight);
+		}
+		if (encode_sample(b, *s, pi, missed, sink, arg, &sent_total))
 			return -1;
 	}
 	/* Anything at the end should be sent */
-	if (transmit(&sent))
+	if (transmit(sink, arg, &sent))
 		return -1;
 	sent_total += sent;
 	if (total)
 		*total = sent_total;
+	if (throttled)
+		throttle_spent(sent_total);
+
+	stats_add(STAT_SAMPLES, b.num_samples);
+	if (b.num_samples)
+		stats_time(STAT_ENCODE_NS, (stats_now() - started) / b.num_samples);
 	return 0;
 }
 
@@ -112,9 +330,80 @@ int network_init(const char *node, const char *service)
 	return 0;
 }
 
+int network_open_file(const char *path, int direct)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if (!strcmp(path, "-")) {
+		output.fd = STDOUT_FILENO;
+		output.close = 0;
+		direct = 0;
+	} else {
+		output.fd = open(path, flags | (direct ? O_DIRECT : 0), 0666);
+		if (output.fd < 0 && direct && errno == EINVAL) {
+			fprintf(stderr, "O_DIRECT not supported for %s, buffering instead.\n", path);
+			direct = 0;
+			output.fd = open(path, flags, 0666);
+		}
+		if (output.fd < 0) {
+			fprintf(stderr, "open error:  %s:  %s\n", path, strerror(errno));
+			return -1;
+		}
+		output.close = 1;
+	}
+
+	output.direct = direct;
+	output.len = 0;
+	if (posix_memalign((void **)(&output.buf), OUTPUT_ALIGN, OUTPUT_BUFFER)) {
+		fprintf(stderr, "Could not allocate output buffer.\n");
+		if (output.close)
+			close(output.fd);
+		output.fd = -1;
+		output.buf = NULL;
+		return -1;
+	}
+
+	if (debug)
+		network_debug = fopen("packet.debug", "wb");
+	return 0;
+}
+
+int network_spool(const char *path, size_t bytes, const char *node, const char *service)
+{
+	if (spool_open(path, bytes, node, service))
+		return -1;
+	spooling = 1;
+
+	if (debug)
+		network_debug = fopen("packet.debug", "wb");
+	return 0;
+}
+
+int network_header(void *header, size_t bytes, size_t *sent)
+{
+	if (!spooling)
+		return network_packet(header, bytes, sent);
+
+	if (network_debug && !fwrite(header, 1, bytes, network_debug)) {
+		fprintf(stderr, "Error writing out network debug info:  %s\n", strerror(errno));
+		return -1;
+	}
+	if (sent)
+		*sent = bytes;
+	return spool_header(header, bytes);
+}
+
 int network_packet(void *packet, size_t bytes, size_t *sent)
 {
-	ssize_t sent_bytes = sendto(the_socket, packet, bytes, 0, NULL, 0);
+	ssize_t sent_bytes = 0;
+	uint64_t started = stats_now();
+
+	if (spooling)
+		sent_bytes = spool_write(packet, bytes) ? -1 : bytes;
+	else if (output.buf)
+		sent_bytes = output_write(packet, bytes) ? -1 : bytes;
+	else
+		sent_bytes = sendto(the_socket, packet, bytes, 0, NULL, 0);
 
 	if (debug)
 		fprintf(stderr, "Writing out packet with %zu bytes.\n", bytes);
@@ -123,10 +412,13 @@ int network_packet(void *packet, size_t bytes, size_t *sent)
 		fprintf(stderr, "Send error:  %s\n", strerror(errno));
 		return -1;
 	}
-	if (sent_bytes != bytes) {
+	if ((size_t)(sent_bytes) != bytes) {
 		fprintf(stderr, "Error, could not send entire packet.\n");
 		return -1;
 	}
+	stats_time(STAT_SEND_NS, stats_now() - started);
+	stats_add(STAT_SENDS, 1);
+	stats_add(STAT_BYTES, bytes);
 	if (network_debug && !fwrite(packet, 1, bytes, network_debug)) {
 		fprintf(stderr, "Error writing out network debug info:  %s\n", strerror(errno));
 		return -1;
@@ -140,8 +432,44 @@ int network_packet(void *packet, size_t bytes, size_t *sent)
 	return 0;
 }
 
+int network_fd()
+{
+	/* Only the spool thread may touch its socket */
+	if (spooling)
+		return -1;
+	if (!output.buf)
+		return the_socket;
+
+	/* Whoever takes the fd over writes unaligned; hand over what we have. */
+	if (output_flush(1))
+		return -1;
+	return output.fd;
+}
+
 int network_finish()
 {
+	size_t sent = 0;
+
+	/* What there is of the last interval */
+	if ((aggregate_enabled() || aggregate_pending()) &&
+	    send_aggregates(direct_sink, NULL, &sent))
+		fprintf(stderr, "Could not send the last aggregate interval.\n");
+
+	throttle_report();
+	if (spooling) {
+		spool_close(SPOOL_DRAIN_MS);
+		spooling = 0;
+	}
+
+	if (output.buf) {
+		output_flush(1);
+		if (output.close)
+			close(output.fd);
+		free(output.buf);
+		output.buf = NULL;
+		output.fd = -1;
+	}
+
 	if (the_socket) {
 		shutdown(the_socket, SHUT_RDWR);
 		close(the_socket);
@@ -162,15 +490,87 @@ int network_finish()
 	return 0;
 }
 
-int transmit(size_t *sent)
+int transmit(packet_sink sink, void *arg, size_t *sent)
 {
 	void *packet = NULL;
 	size_t bytes = 0;
 
+	*sent = 0;
 	if (packet_create(&packet, &bytes))
 		return -1;
 	if (!packet)
 		return 0;
 
+	stats_add(STAT_PACKETS, 1);
+	return emit(sink, arg, packet, bytes, sent);
+}
+
+int direct_sink(void *packet, size_t bytes, size_t *sent, void *arg)
+{
+	(void)(arg);
 	return network_packet(packet, bytes, sent);
 }
+
+static int write_all(const char *data, size_t bytes)
+{
+	while (bytes) {
+		ssize_t rc = write(output.fd, data, bytes);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		data += rc;
+		bytes -= rc;
+	}
+	return 0;
+}
+
+int output_write(const void *data, size_t bytes)
+{
+	const char *ptr = (const char *)(data);
+
+	while (bytes) {
+		size_t n = OUTPUT_BUFFER - output.len;
+		if (n > bytes)
+			n = bytes;
+		memcpy(output.buf + output.len, ptr, n);
+		output.len += n;
+		ptr += n;
+		bytes -= n;
+		if (output.len == OUTPUT_BUFFER && output_flush(0))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write out the buffer.  O_DIRECT needs aligned lengths, so the final
+ * partial block is written after switching O_DIRECT off again.
+ */
+int output_flush(int final)
+{
+	size_t aligned = output.len;
+
+	if (output.direct)
+		aligned &= ~(size_t)(OUTPUT_ALIGN - 1);
+	if (aligned && write_all(output.buf, aligned))
+		return -1;
+
+	output.len -= aligned;
+	if (output.len)
+		memmove(output.buf, output.buf + aligned, output.len);
+	if (!final)
+		return 0;
+
+	/* Callers write to the fd themselves after this, aligned or not */
+	if (output.direct) {
+		fcntl(output.fd, F_SETFL, fcntl(output.fd, F_GETFL) & ~O_DIRECT);
+		output.direct = 0;
+	}
+	if (!output.len)
+		return 0;
+	if (write_all(output.buf, output.len))
+		return -1;
+	output.len = 0;
+	return 0;
+}
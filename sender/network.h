@@ -2,13 +2,34 @@
 #ifndef ANDROID_ARM_PROJECT_NETWORK_H
 #define ANDROID_ARM_PROJECT_NETWORK_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "sample_buffer.h"
 
+/*
+ * Receives each encoded packet.  Returns 0 on success, -1 on error.
+ * The packet memory is only valid for the duration of the call.
+ */
+typedef int (*packet_sink)(void *packet, size_t bytes, size_t *sent, void *arg);
+
 void network_set_debug();
 
 int network_init(const char *node, const char *service);
+int network_open_file(const char *path, int direct); /* "-" is stdout */
+int network_spool(const char *path, size_t bytes, const char *node,
+    const char *service); /* Send through a ring file; see spool.h */
 int network_finish();
-int network_send(struct buffer &b, uint32_t missed, size_t *total);
+/*
+ * Encode and send b.  dropped is the number of samples the caller threw
+ * away on b's core since the previous buffer it passed for that core;
+ * with the module's own count in b it goes into the packets' missed.
+ */
+int network_send(struct buffer &b, uint32_t dropped, size_t *total);
+int network_encode(struct buffer &b, uint32_t dropped, packet_sink sink, void *arg,
+    size_t *total); /* Like network_send, but packets go to sink */
+int network_header(void *header, size_t bytes, size_t *sent); /* Experiment info */
 int network_packet(void *name, size_t bytes, size_t *sent); /* Direct write! */
+int network_fd(); /* The socket or file, for engines that do their own I/O */
 
 #endif
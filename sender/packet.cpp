@@ -4,10 +4,14 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "packet.h"
 #include "process_info.h"
 
-#define NUM_COUNTERS (6)
+#define MAX_PROCESSES (255)
 
 static struct {
 	void *ptr;
@@ -16,60 +20,441 @@ static struct {
 
 static struct packet_header header;
 
+/* Processes in the packet being built; only ever one unless MULTIPID */
 static struct {
+	uint32_t pid;
+	uint32_t id;		/* Process-table id, PROCTABLE only */
+	uint8_t kernel;
 	const char *cmdline;
 	const char *exe;
-} info;
+} procs[MAX_PROCESSES];
+static size_t nprocs = 0;
+static size_t last_proc = 0;
+static uint8_t sample_proc[PACKET_MAX_SAMPLES];	/* Index into procs for each sample */
+
+/* Process records built by the sender */
+static struct {
+	void *ptr;
+	size_t n;
+} record;
+static uint32_t next_process_id = 1;
+
+/* Ids the reader may forget, for the next retire record, and the last one's */
+static std::vector<uint32_t> retired;
+static std::vector<uint32_t> retired_last;
+static struct {
+	void *ptr;
+	size_t n;
+} retire_out;
+
+/* The reader's process table, PROCTABLE only */
+struct process_entry {
+	uint32_t pid;
+	uint8_t kernel;
+	std::string cmdline;
+	std::string exe;
+};
+
+/* What a reader has to keep per stream; see packet_stream_select */
+struct packet_stream {
+	uint32_t format;
+	std::unordered_map<uint32_t, process_entry> processes;
+	std::vector<uint32_t> retired;	/* Skipped over; see packet_retire_skipped */
+};
+static struct packet_stream default_stream;
+static struct packet_stream *stream = &default_stream;
+
+/*
+ * Aggregate records:  the one being built, and the one read last.  What
+ * packet_read leaves behind is per thread, so threads can decode packets
+ * of one stream at once (see packet_skip).
+ */
+static struct {
+	void *ptr;
+	size_t n;
+} aggregate_out;
+static thread_local struct packet_interval read_interval;
+static thread_local std::vector<struct packet_aggregate> read_aggregates;
+
+/* The processes of the packet packet_read returned last, for packet_run */
+static thread_local struct packet_process read_procs[MAX_PROCESSES];
+static thread_local size_t read_nprocs = 0;
+static thread_local uint8_t read_index[PACKET_MAX_SAMPLES];
 
-static struct sample samples[256];
+static struct sample samples[PACKET_MAX_SAMPLES];
 static int initialized = 0;
 static int current_index = 0;
+static uint32_t format = 0;
+static uint8_t num_counters = PACKET_MAX_COUNTERS;
+static uint32_t sample_weight = 1;
 
 static int debug = 0;
 
 static void initialize();
 static void clear_data();
 static size_t demand_memory();
-static void read_header(void *base, struct packet_header *hdr);
+static int read_header(void *base, struct packet_header *hdr);
 static void read_samples(void *base, struct sample *buf, struct packet_header *hdr);
+static int read_columns(void *base, void *end, struct sample *buf, struct packet_header *hdr,
+    size_t *read);
 static int read_info(char *base, size_t bytes, char **cmdline, char **exe, size_t *read);
+static int read_process(void *base, size_t n, size_t *read);
+static int read_retire(void *base, size_t n, int now, size_t *read);
+static int read_aggregate(void *base, size_t n, size_t *read);
+static int skip_aggregate(void *base, size_t n, size_t *read);
+static void *read_dictionary(void *base, struct packet_header *hdr);
+static int find_proc(uint32_t pid, uint32_t id);
 static void* write_header(void *base);
 static void* write_samples(void *base);
+static void* write_columns(void *base);
+static void* write_dictionary(void *base);
 static void* write_info(void *base);
 
 #define offset(ptr, amt) ((void *)(((size_t)(ptr)) + (amt)))
 
+/* Longest varint a 64-bit value needs (get_varint rejects longer ones) */
+#define VARINT_MAX_BYTES (10)
+
+/* The per-sample dictionary indices are padded to keep samples aligned */
+#define pad4(n) (((n) + 3) & ~(size_t)(3))
+
 void packet_set_debug()
 {
 	debug = 1;
 }
 
+void packet_set_format(uint32_t fmt)
+{
+	format = fmt;
+}
+
+uint32_t packet_get_format()
+{
+	return format;
+}
+
+struct packet_stream *packet_stream_new()
+{
+	struct packet_stream *s = new packet_stream();
+
+	s->format = 0;
+	return s;
+}
+
+void packet_stream_free(struct packet_stream *s)
+{
+	if (s == stream)
+		packet_stream_select(NULL);
+	delete s;
+}
+
+void packet_stream_select(struct packet_stream *s)
+{
+	stream->format = format;
+	stream = s ? s : &default_stream;
+	format = stream->format;
+}
+
+void packet_set_counters(uint8_t counters)
+{
+	num_counters = counters < PACKET_MAX_COUNTERS ? counters : PACKET_MAX_COUNTERS;
+}
+
+void packet_set_weight(uint32_t weight)
+{
+	sample_weight = weight;
+}
+
+/* Bytes in a packet header on the wire */
+static size_t header_size()
+{
+	return 20 + ((format & PACKET_FORMAT_WIDE) ? 4 : 0) +
+	    ((format & PACKET_FORMAT_WEIGHTED) ? 4 : 0);
+}
+
+/* Bytes per sample in the plain layout: cycles (two words if WIDE), then counters */
+static size_t sample_size(uint8_t counters)
+{
+	return sizeof(uint32_t) * (counters + ((format & PACKET_FORMAT_WIDE) ? 2 : 1));
+}
+
+static size_t max_quantity()
+{
+	return (format & PACKET_FORMAT_WIDE) ? PACKET_MAX_SAMPLES : 255;
+}
+
+uint32_t packet_parse_format(const char *info)
+{
+	/* The empty event5/event6 values leave no line break before it */
+	const char *line = strstr(info, "format:");
+
+	return line ? (uint32_t)(strtoul(line + 7, NULL, 0)) : 0;
+}
+
+int packet_format_by_name(const char *names, uint32_t *fmt)
+{
+	static const struct {
+		const char *name;
+		uint32_t flag;
+	} known[] = {
+		{ "columnar", PACKET_FORMAT_COLUMNAR },
+		{ "proctable", PACKET_FORMAT_PROCTABLE },
+		{ "multipid", PACKET_FORMAT_MULTIPID },
+		{ "wide", PACKET_FORMAT_WIDE },
+		{ "weighted", PACKET_FORMAT_WEIGHTED },
+		{ "aggregate", PACKET_FORMAT_AGGREGATE },
+	};
+	const char *name = names;
+	size_t i = 0;
+
+	*fmt = 0;
+	while (*name) {
+		size_t len = strcspn(name, ",");
+		for (i = 0; i < sizeof(known) / sizeof(known[0]); ++i) {
+			if (strlen(known[i].name) == len && !strncmp(known[i].name, name, len))
+				break;
+		}
+		if (i == sizeof(known) / sizeof(known[0]))
+			return -1;
+		*fmt |= known[i].flag;
+		name += len;
+		if (*name == ',')
+			++name;
+	}
+	return 0;
+}
+
 int packet_read(void *base, size_t n, struct packet_header *hdr,
     struct sample *buf, char **cmdline, char **exe, size_t *read)
 {
 	size_t amt = 0;
+	size_t i = 0;
 	*read = 0;
 
-	amt = sizeof(struct packet_header);
+	/* Process records can be shorter than a packet header */
+	if (n == 0)
+		return 1;
+	if ((format & (PACKET_FORMAT_PROCTABLE | PACKET_FORMAT_AGGREGATE)) &&
+	    (*(uint8_t *)(base) & PACKET_RECORD_PROCESS)) {
+		if (*(uint8_t *)(base) == PACKET_RECORD_AGGREGATE)
+			return read_aggregate(base, n, read);
+		if (*(uint8_t *)(base) == PACKET_RECORD_RETIRE)
+			return read_retire(base, n, 1, read);
+		return read_process(base, n, read);
+	}
+
+	amt = header_size();
 	if (n < amt)
 		return 1;
 
-	read_header(base, hdr);
+	if (read_header(base, hdr))
+		return -1;
 	n -= amt;
 	*read += amt;
 	base = offset(base, amt);
 
-	amt = sizeof(uint32_t) * (NUM_COUNTERS + 1) * hdr->quantity;
+	if (hdr->counters > PACKET_MAX_COUNTERS || hdr->quantity > max_quantity())
+		return -1;
 
-	if (n < amt)
-		return 1;
+	if (format & PACKET_FORMAT_MULTIPID) {
+		/* The pid field holds the number of dictionary entries */
+		if (!hdr->pid || hdr->pid > MAX_PROCESSES)
+			return -1;
+		amt = 4 * hdr->pid + pad4(hdr->quantity);
+		if (n < amt)
+			return 1;
+		if (!read_dictionary(base, hdr))
+			return -1;
+		n -= amt;
+		*read += amt;
+		base = offset(base, amt);
+	} else {
+		read_nprocs = 1;
+		read_procs[0].pid = hdr->pid;
+		read_procs[0].kernel = hdr->kernel;
+		memset(&read_index[0], 0, hdr->quantity);
+	}
 
-	read_samples(base, buf, hdr);
+	if (format & PACKET_FORMAT_PROCTABLE) {
+		for (i = 0; i < read_nprocs; ++i) {
+			auto entry = stream->processes.find(read_procs[i].pid);
+			if (entry == stream->processes.end())
+				return -1;
+			read_procs[i].pid = entry->second.pid;
+			read_procs[i].cmdline = entry->second.cmdline.c_str();
+			read_procs[i].exe = entry->second.exe.c_str();
+		}
+	}
+
+	if (format & PACKET_FORMAT_COLUMNAR) {
+		int rc = read_columns(base, offset(base, n), buf, hdr, &amt);
+		if (rc)
+			return rc;
+	} else {
+		amt = sample_size(hdr->counters) * hdr->quantity;
+		if (n < amt)
+			return 1;
+		read_samples(base, buf, hdr);
+	}
 	n -= amt;
 	*read += amt;
 	base = offset(base, amt);
 
-	return read_info((char *)(base), n, cmdline, exe, read);
+	if (!(format & PACKET_FORMAT_PROCTABLE)) {
+		for (i = 0; i < read_nprocs; ++i) {
+			size_t before = *read;
+			if (read_info((char *)(base), n, cmdline, exe, read))
+				return 1;
+			read_procs[i].cmdline = *cmdline;
+			read_procs[i].exe = *exe;
+			n -= *read - before;
+			base = offset(base, *read - before);
+		}
+	}
+
+	if (format & (PACKET_FORMAT_PROCTABLE | PACKET_FORMAT_MULTIPID)) {
+		for (i = 0; i < hdr->quantity; ++i)
+			buf[i].pid = read_procs[read_index[i]].pid;
+	}
+
+	/* Describe the packet by its first process */
+	hdr->pid = read_procs[read_index[0]].pid;
+	hdr->kernel = read_procs[read_index[0]].kernel;
+	*cmdline = (char *)(read_procs[read_index[0]].cmdline);
+	*exe = (char *)(read_procs[read_index[0]].exe);
+	return 0;
+}
+
+/*
+ * packet_skip and packet_peek:  find where the record ends, and with
+ * peek, describe a packet by its first sample's process as packet_read
+ * would.
+ */
+static int skip_record(void *base, size_t n, struct packet_header *hdr,
+    char **cmdline, char **exe, int peek, size_t *read)
+{
+	const uint8_t *p = NULL;
+	const uint8_t *end = (const uint8_t *)(base) + n;
+	size_t amt = header_size();
+	size_t values = 0;
+	size_t run = 0;		/* Bytes of the varint p is in */
+	size_t nprocs = 1;
+	size_t first = 0;	/* First sample's process in the packet */
+	size_t i = 0;
+
+	*read = 0;
+	if (n == 0)
+		return 1;
+	if ((format & (PACKET_FORMAT_PROCTABLE | PACKET_FORMAT_AGGREGATE)) &&
+	    (*(uint8_t *)(base) & PACKET_RECORD_PROCESS)) {
+		if (*(uint8_t *)(base) == PACKET_RECORD_AGGREGATE)
+			return skip_aggregate(base, n, read);
+		if (*(uint8_t *)(base) == PACKET_RECORD_RETIRE)
+			return read_retire(base, n, 0, read);
+		return read_process(base, n, read);
+	}
+	if (n < amt)
+		return 1;
+
+	if (read_header(base, hdr))
+		return -1;
+	if (hdr->counters > PACKET_MAX_COUNTERS || hdr->quantity > max_quantity())
+		return -1;
+	if (format & PACKET_FORMAT_MULTIPID) {
+		const uint32_t *ints = (const uint32_t *)(offset(base, amt));
+
+		nprocs = hdr->pid;
+		if (!nprocs || nprocs > MAX_PROCESSES)
+			return -1;
+		amt += 4 * nprocs + pad4(hdr->quantity);
+		if (n < amt)
+			return 1;
+		if (peek) {
+			first = hdr->quantity ? ((const uint8_t *)(ints + nprocs))[0] : 0;
+			if (first >= nprocs)
+				return -1;
+			hdr->pid = ntohl(ints[first]) & 0x7fffffffU;
+			hdr->kernel = (ntohl(ints[first]) & 0x80000000U) ? 1 : 0;
+		}
+	}
+
+	if (peek && (format & PACKET_FORMAT_PROCTABLE)) {
+		auto entry = stream->processes.find(hdr->pid);
+		if (entry == stream->processes.end())
+			return -1;
+		hdr->pid = entry->second.pid;
+		*cmdline = (char *)(entry->second.cmdline.c_str());
+		*exe = (char *)(entry->second.exe.c_str());
+	}
+
+	if (format & PACKET_FORMAT_COLUMNAR) {
+		/* Each varint ends with the first byte under 0x80 */
+		values = (size_t)(hdr->quantity) * (1 + hdr->counters);
+		for (p = (const uint8_t *)(offset(base, amt)); values && p < end; ++p) {
+			if (!(*p & 0x80)) {
+				--values;
+				run = 0;
+			} else if (++run == VARINT_MAX_BYTES) {
+				return -1;
+			}
+		}
+		if (values)
+			return 1;
+		amt = p - (const uint8_t *)(base);
+	} else {
+		amt += sample_size(hdr->counters) * hdr->quantity;
+		if (n < amt)
+			return 1;
+	}
+
+	/* cmdline and exe of each process */
+	if (!(format & PACKET_FORMAT_PROCTABLE)) {
+		for (i = 0; i < 2 * nprocs; ++i) {
+			p = (const uint8_t *)(memchr(offset(base, amt), '\0', n - amt));
+			if (!p)
+				return 1;
+			if (peek && i == 2 * first)
+				*cmdline = (char *)(offset(base, amt));
+			if (peek && i == 2 * first + 1)
+				*exe = (char *)(offset(base, amt));
+			amt = p + 1 - (const uint8_t *)(base);
+		}
+	}
+
+	*read = amt;
+	return 0;
+}
+
+int packet_skip(void *base, size_t n, size_t *read)
+{
+	struct packet_header hdr;
+
+	return skip_record(base, n, &hdr, NULL, NULL, 0, read);
+}
+
+int packet_peek(void *base, size_t n, struct packet_header *hdr,
+    char **cmdline, char **exe, size_t *read)
+{
+	return skip_record(base, n, hdr, cmdline, exe, 1, read);
+}
+
+size_t packet_run(const struct packet_header *hdr, size_t start,
+    struct packet_header *run, char **cmdline, char **exe)
+{
+	uint8_t idx = read_index[start];
+	size_t end = start + 1;
+
+	while (end < hdr->quantity && read_index[end] == idx)
+		++end;
+
+	*run = *hdr;
+	run->pid = read_procs[idx].pid;
+	run->kernel = read_procs[idx].kernel;
+	run->quantity = end - start;
+	run->first_index = hdr->first_index + start;
+	*cmdline = (char *)(read_procs[idx].cmdline);
+	*exe = (char *)(read_procs[idx].exe);
+	return end - start;
 }
 
 int packet_should_create(struct buffer& b, struct sample& s, struct ProcessInfo& pi)
@@ -80,14 +465,27 @@ int packet_should_create(struct buffer& b, struct sample& s, struct ProcessInfo&
 	if (!header.quantity)
 		return 0;
 
-	make =	(header.quantity == 255 ||
+	if (format & PACKET_FORMAT_MULTIPID) {
+		make =	(header.quantity == max_quantity() ||
+			 header.core != (uint8_t)(b.core) ||
+			 header.weight != sample_weight ||
+			 (nprocs == MAX_PROCESSES && find_proc(s.pid, pi.wire.id) < 0));
+
+		if (debug && make)
+			fprintf(stderr, "CREATING:  MULTIPID PACKET FULL OR DIFFERENT CORE!\n");
+		return make;
+	}
+
+	make =	(header.quantity == max_quantity() ||
 		 (header.kernel && pi.mode != ProcessInfo::Kernel) ||
  		 header.core != (uint8_t)(b.core) ||
-		 header.pid != s.pid);
+		 header.pid != s.pid ||
+		 header.weight != sample_weight ||
+		 procs[0].id != pi.wire.id);
 
 	if (debug && make) {
 		fprintf(stderr, "CREATING:");
-		if (header.quantity == 255)
+		if (header.quantity == max_quantity())
 			fprintf(stderr, "  HEADER FULL!");
 		if (header.kernel && pi.mode != ProcessInfo::Kernel)
 			fprintf(stderr, "  MODE CHANGE!");
@@ -95,6 +493,8 @@ int packet_should_create(struct buffer& b, struct sample& s, struct ProcessInfo&
 			fprintf(stderr, "  DIFFERENT CORE!");
 		if (header.pid != s.pid)
 			fprintf(stderr, "  DIFFERENT PID!");
+		if (header.weight != sample_weight)
+			fprintf(stderr, "  DIFFERENT WEIGHT!");
 		fprintf(stderr, "\n");
 	}
 
@@ -106,6 +506,32 @@ int packet_empty()
 	return (header.quantity == 0);
 }
 
+int packet_can_refresh(uint32_t pid)
+{
+	if (format & PACKET_FORMAT_MULTIPID)
+		return find_proc(pid, 0) < 0;
+	return packet_empty();
+}
+
+/* Find pid (with process-table id, if non-zero) in the packet, or -1 */
+int find_proc(uint32_t pid, uint32_t id)
+{
+	size_t i = 0;
+
+	/* Consecutive samples are usually from the same process */
+	if (last_proc < nprocs && procs[last_proc].pid == pid &&
+	    (!id || procs[last_proc].id == id))
+		return last_proc;
+
+	for (i = 0; i < nprocs; ++i) {
+		if (procs[i].pid == pid && (!id || procs[i].id == id)) {
+			last_proc = i;
+			return i;
+		}
+	}
+	return -1;
+}
+
 int packet_create(void **save, size_t *packet_size)
 {
 	void *ptr = NULL;
@@ -121,16 +547,21 @@ int packet_create(void **save, size_t *packet_size)
 		return 0;
 	}
 
-	*packet_size = demand_memory();
-	if (!*packet_size)
+	if (!demand_memory())
 		return -1;
 
-	if (debug)
-		fprintf(stderr, "CREATING PACKET WITH %zu BYTES!\n", *packet_size);
-
 	ptr = write_header(memory.ptr);
-	ptr = write_samples(ptr);
+	if (format & PACKET_FORMAT_MULTIPID)
+		ptr = write_dictionary(ptr);
+	if (format & PACKET_FORMAT_COLUMNAR)
+		ptr = write_columns(ptr);
+	else
+		ptr = write_samples(ptr);
 	ptr = write_info(ptr);
+	*packet_size = (size_t)(ptr) - (size_t)(memory.ptr);
+
+	if (debug)
+		fprintf(stderr, "CREATED PACKET WITH %zu BYTES!\n", *packet_size);
 
 	clear_data();
 	*save = memory.ptr;
@@ -139,6 +570,8 @@ int packet_create(void **save, size_t *packet_size)
 
 int packet_append(struct buffer& b, struct sample& s, struct ProcessInfo& pi, uint32_t missed)
 {
+	int proc = 0;
+
 	initialize();
 	if (packet_should_create(b, s, pi))
 		return -1;
@@ -150,23 +583,341 @@ int packet_append(struct buffer& b, struct sample& s, struct ProcessInfo& pi, ui
 		header.kernel = (pi.mode == ProcessInfo::Kernel) ? 1 : 0;
 		header.missed = missed;
 		header.first_index = current_index;
-		header.counters = (uint8_t) NUM_COUNTERS;
+		header.counters = num_counters;
 		header.core = (uint8_t)(b.core);
 		header.pid = s.pid;
+		header.weight = sample_weight;
+	}
 
-		info.cmdline = pi.cmdline.c_str();
-		info.exe = pi.executable.c_str();
+	proc = find_proc(s.pid, pi.wire.id);
+	if (proc < 0) {
+		if (debug)
+			fprintf(stderr, "ADDING PROCESS %lu!\n", s.pid);
+
+		proc = last_proc = nprocs++;
+		procs[proc].pid = s.pid;
+		procs[proc].id = pi.wire.id;
+		procs[proc].kernel = (pi.mode == ProcessInfo::Kernel) ? 1 : 0;
+		procs[proc].cmdline = pi.cmdline;
+		procs[proc].exe = pi.executable;
 	}
 
 	if (debug)
 		fprintf(stderr, "ADDING SAMPLE!\n");
 
+	sample_proc[header.quantity] = (uint8_t)(proc);
 	samples[header.quantity] = s;
 	++header.quantity;
 	++current_index;
 	return 0;
 }
 
+int packet_process_record(struct ProcessInfo& pi, void **save, size_t *bytes)
+{
+	size_t cmdlen = strlen(pi.cmdline) + 1;
+	size_t exelen = strlen(pi.executable) + 1;
+	size_t amt = 12 + cmdlen + exelen;
+	uint8_t *ptr = NULL;
+	uint32_t *ints = NULL;
+
+	*save = NULL;
+	*bytes = 0;
+	if (!(format & PACKET_FORMAT_PROCTABLE))
+		return 0;
+	if (pi.wire.id && pi.wire.generation == pi.generation)
+		return 0;
+
+	/* A new id per generation, so table entries never change under a reader */
+	packet_retire(pi);
+	pi.wire.id = next_process_id++;
+	pi.wire.generation = pi.generation;
+
+	if (amt > record.n) {
+		void *mem = realloc(record.ptr, amt);
+		if (!mem)
+			return -1;
+		record.ptr = mem;
+		record.n = amt;
+	}
+
+	if (debug)
+		fprintf(stderr, "CREATING PROCESS RECORD %u FOR PID %u!\n", pi.wire.id, pi.pid);
+
+	ptr = (uint8_t *)(record.ptr);
+	ptr[0] = PACKET_RECORD_PROCESS;
+	ptr[1] = (pi.mode == ProcessInfo::Kernel) ? 1 : 0;
+	ptr[2] = 0;
+	ptr[3] = 0;
+	ints = (uint32_t *)(ptr + 4);
+	ints[0] = htonl(pi.wire.id);
+	ints[1] = htonl(pi.pid);
+	memcpy(ptr + 12, pi.cmdline, cmdlen);
+	memcpy(ptr + 12 + cmdlen, pi.executable, exelen);
+
+	*save = record.ptr;
+	*bytes = amt;
+	return 0;
+}
+
+int read_process(void *base, size_t n, size_t *read)
+{
+	uint32_t *ints = (uint32_t *)(offset(base, 4));
+	char *cmdline = NULL;
+	char *exe = NULL;
+	size_t amt = 12;
+	process_entry entry;
+
+	if (n < amt)
+		return 1;
+	if (read_info((char *)(offset(base, amt)), n - amt, &cmdline, &exe, &amt))
+		return 1;
+
+	entry.pid = ntohl(ints[1]);
+	entry.kernel = *(uint8_t *)(offset(base, 1));
+	entry.cmdline = cmdline;
+	entry.exe = exe;
+	stream->processes[ntohl(ints[0])] = entry;
+
+	*read = amt;
+	return 2;
+}
+
+void packet_retire(struct ProcessInfo& pi)
+{
+	if (pi.wire.id)
+		retired.push_back(pi.wire.id);
+	pi.wire.id = 0;
+}
+
+int packet_retire_record(void **save, size_t *bytes)
+{
+	size_t amt = 8 + 4 * retired.size();
+	uint8_t *ptr = NULL;
+	uint32_t *ints = NULL;
+	size_t i = 0;
+
+	*save = NULL;
+	*bytes = 0;
+	retired_last.clear();
+	if (retired.empty())
+		return 0;
+	if (amt > retire_out.n) {
+		void *mem = realloc(retire_out.ptr, amt);
+		if (!mem)
+			return -1;
+		retire_out.ptr = mem;
+		retire_out.n = amt;
+	}
+
+	if (debug)
+		fprintf(stderr, "RETIRING %zu PROCESS IDS!\n", retired.size());
+
+	ptr = (uint8_t *)(retire_out.ptr);
+	ptr[0] = PACKET_RECORD_RETIRE;
+	ptr[1] = 0;
+	ptr[2] = 0;
+	ptr[3] = 0;
+	ints = (uint32_t *)(ptr + 4);
+	ints[0] = htonl(retired.size());
+	for (i = 0; i < retired.size(); ++i)
+		ints[1 + i] = htonl(retired[i]);
+	retired.swap(retired_last);
+
+	*save = retire_out.ptr;
+	*bytes = amt;
+	return 0;
+}
+
+size_t packet_retired(const uint32_t **ids)
+{
+	*ids = retired_last.empty() ? NULL : &retired_last[0];
+	return retired_last.size();
+}
+
+/* Take in a retire record; the ids go at once, or at packet_retire_skipped */
+int read_retire(void *base, size_t n, int now, size_t *read)
+{
+	uint32_t *ints = (uint32_t *)(offset(base, 4));
+	size_t count = 0;
+	size_t amt = 8;
+	size_t i = 0;
+
+	if (n < amt)
+		return 1;
+	count = ntohl(ints[0]);
+	if (count > (n - amt) / 4)
+		return 1;
+	amt += 4 * count;
+
+	for (i = 0; i < count; ++i)
+		stream->retired.push_back(ntohl(ints[1 + i]));
+	if (now)
+		packet_retire_skipped();
+
+	*read = amt;
+	return 2;
+}
+
+void packet_retire_skipped()
+{
+	size_t i = 0;
+
+	for (i = 0; i < stream->retired.size(); ++i)
+		stream->processes.erase(stream->retired[i]);
+	stream->retired.clear();
+}
+
+/*
+ * Aggregate records:  a 28 byte head, then 20 bytes plus two UINTs per
+ * counter for each entry.  64-bit values go high word first.
+ */
+#define AGGREGATE_HEAD (28)
+
+static size_t aggregate_entry_size(uint8_t counters)
+{
+	return 20 + 8 * counters;
+}
+
+static void put64(uint32_t *ints, uint64_t v)
+{
+	ints[0] = htonl((uint32_t)(v >> 32));
+	ints[1] = htonl((uint32_t)(v));
+}
+
+static uint64_t get64(const uint32_t *ints)
+{
+	return ((uint64_t)(ntohl(ints[0])) << 32) | ntohl(ints[1]);
+}
+
+int packet_aggregate_record(const struct packet_interval *iv,
+    const struct packet_aggregate *entries, size_t n, void **save, size_t *bytes)
+{
+	size_t amt = AGGREGATE_HEAD + n * aggregate_entry_size(num_counters);
+	uint8_t *ptr = NULL;
+	uint32_t *ints = NULL;
+	size_t i = 0;
+	uint8_t c = 0;
+
+	*save = NULL;
+	*bytes = 0;
+	if (amt > aggregate_out.n) {
+		void *mem = realloc(aggregate_out.ptr, amt);
+		if (!mem)
+			return -1;
+		aggregate_out.ptr = mem;
+		aggregate_out.n = amt;
+	}
+
+	if (debug)
+		fprintf(stderr, "CREATING AGGREGATE RECORD %u WITH %zu ENTRIES!\n", iv->number, n);
+
+	ptr = (uint8_t *)(aggregate_out.ptr);
+	ptr[0] = PACKET_RECORD_AGGREGATE;
+	ptr[1] = num_counters;
+	ptr[2] = 0;
+	ptr[3] = 0;
+	ints = (uint32_t *)(ptr + 4);
+	ints[0] = htonl(n);
+	ints[1] = htonl(iv->number);
+	put64(ints + 2, iv->start_ms);
+	ints[4] = htonl(iv->length_ms);
+	ints[5] = htonl(iv->missed);
+	ints += 6;
+
+	for (i = 0; i < n; ++i) {
+		const struct packet_aggregate *e = &entries[i];
+		uint8_t *flags = (uint8_t *)(ints + 1);
+
+		ints[0] = htonl(e->id);
+		flags[0] = e->core;
+		flags[1] = e->kernel;
+		flags[2] = 0;
+		flags[3] = 0;
+		ints[2] = htonl(e->samples);
+		put64(ints + 3, e->cycles);
+		for (c = 0; c < num_counters; ++c)
+			put64(ints + 5 + 2 * c, e->sums[c]);
+		ints += 5 + 2 * num_counters;
+	}
+
+	*save = aggregate_out.ptr;
+	*bytes = amt;
+	return 0;
+}
+
+int read_aggregate(void *base, size_t n, size_t *read)
+{
+	const uint8_t *ptr = (const uint8_t *)(base);
+	const uint32_t *ints = (const uint32_t *)(ptr + 4);
+	size_t amt = AGGREGATE_HEAD;
+	size_t i = 0;
+	uint8_t c = 0;
+
+	if (n < amt)
+		return 1;
+	if (ptr[1] > PACKET_MAX_COUNTERS)
+		return -1;
+
+	read_interval.counters = ptr[1];
+	read_interval.quantity = ntohl(ints[0]);
+	read_interval.number = ntohl(ints[1]);
+	read_interval.start_ms = get64(ints + 2);
+	read_interval.length_ms = ntohl(ints[4]);
+	read_interval.missed = ntohl(ints[5]);
+	if (read_interval.quantity > (n - amt) / aggregate_entry_size(read_interval.counters))
+		return 1;
+	amt += read_interval.quantity * aggregate_entry_size(read_interval.counters);
+	ints += 6;
+
+	read_aggregates.resize(read_interval.quantity);
+	for (i = 0; i < read_interval.quantity; ++i) {
+		struct packet_aggregate *e = &read_aggregates[i];
+		const uint8_t *flags = (const uint8_t *)(ints + 1);
+		auto entry = stream->processes.find(ntohl(ints[0]));
+
+		if (entry == stream->processes.end())
+			return -1;
+		e->id = entry->first;
+		e->pid = entry->second.pid;
+		e->cmdline = entry->second.cmdline.c_str();
+		e->exe = entry->second.exe.c_str();
+		e->core = flags[0];
+		e->kernel = flags[1];
+		e->samples = ntohl(ints[2]);
+		e->cycles = get64(ints + 3);
+		for (c = 0; c < read_interval.counters; ++c)
+			e->sums[c] = get64(ints + 5 + 2 * c);
+		for (; c < PACKET_MAX_COUNTERS; ++c)
+			e->sums[c] = 0;
+		ints += 5 + 2 * read_interval.counters;
+	}
+
+	*read = amt;
+	return 3;
+}
+
+int skip_aggregate(void *base, size_t n, size_t *read)
+{
+	const uint8_t *ptr = (const uint8_t *)(base);
+	size_t quantity = 0;
+
+	if (n < AGGREGATE_HEAD)
+		return 1;
+	if (ptr[1] > PACKET_MAX_COUNTERS)
+		return -1;
+	quantity = ntohl(*(const uint32_t *)(ptr + 4));
+	if (quantity > (n - AGGREGATE_HEAD) / aggregate_entry_size(ptr[1]))
+		return 1;
+	*read = AGGREGATE_HEAD + quantity * aggregate_entry_size(ptr[1]);
+	return 3;
+}
+
+const struct packet_aggregate *packet_aggregates(struct packet_interval *iv)
+{
+	*iv = read_interval;
+	return read_aggregates.empty() ? NULL : &read_aggregates[0];
+}
+
 void packet_start_batch()
 {
 	if (debug)
@@ -185,24 +936,49 @@ void packet_clean()
 		free(memory.ptr);
 	memory.ptr = NULL;
 	memory.n = 0;
+	if (record.ptr)
+		free(record.ptr);
+	record.ptr = NULL;
+	record.n = 0;
+	free(aggregate_out.ptr);
+	aggregate_out.ptr = NULL;
+	aggregate_out.n = 0;
+	free(retire_out.ptr);
+	retire_out.ptr = NULL;
+	retire_out.n = 0;
+	std::vector<uint32_t>().swap(retired);
+	std::vector<uint32_t>().swap(retired_last);
 }
 
 void clear_data()
 {
 	uint32_t batch = header.batch;
+	size_t used = header.quantity;
+	memset(&samples[0], 0, sizeof(struct sample) * used);
 	memset(&header, 0, sizeof(header));
-	memset(&samples[0], 0, sizeof(struct sample) * 256);
-	memset(&info, 0, sizeof(info));
+	nprocs = 0;
+	last_proc = 0;
 	header.batch = batch;
 }
 
+/* Make sure there is room for the packet; returns an upper bound on its size. */
 size_t demand_memory()
 {
 	size_t amt = 0;
-
-	amt = 20 + /* Bytes written to a packet header */
-	      (4 * (NUM_COUNTERS + 1) * header.quantity) +
-	      strlen(info.cmdline)+1 + strlen(info.exe)+1;
+	size_t i = 0;
+	size_t body = sample_size(header.counters) * header.quantity;
+
+	/* Worst case varints: 10 bytes for cycles, 5 for each counter */
+	if (format & PACKET_FORMAT_COLUMNAR)
+		body = (10 + 5 * header.counters) * header.quantity;
+
+	amt = header_size() + body;
+	if (format & PACKET_FORMAT_MULTIPID)
+		amt += 4 * nprocs + pad4(header.quantity);
+	if (!(format & PACKET_FORMAT_PROCTABLE)) {
+		for (i = 0; i < nprocs; ++i)
+			amt += strlen(procs[i].cmdline)+1 + strlen(procs[i].exe)+1;
+	}
 
 	if (amt <= memory.n)
 		return amt;
@@ -215,7 +991,8 @@ size_t demand_memory()
 	return amt;
 }
 
-void read_header(void *base, struct packet_header *hdr)
+/* Returns 0, or -1 if a WIDE sample count is out of range */
+int read_header(void *base, struct packet_header *hdr)
 {
 	uint8_t *bytes = (uint8_t *)(base);
 	uint32_t *ints = NULL;
@@ -227,10 +1004,19 @@ void read_header(void *base, struct packet_header *hdr)
 	bytes += 4;
 
 	ints = (uint32_t *)(bytes);
+	if (format & PACKET_FORMAT_WIDE) {
+		uint32_t quantity = ntohl(ints[0]);
+		if (quantity > PACKET_MAX_SAMPLES)
+			return -1;
+		hdr->quantity = (uint16_t)(quantity);
+		++ints;
+	}
 	hdr->batch = ntohl(ints[0]);
 	hdr->missed = ntohl(ints[1]);
 	hdr->first_index = ntohl(ints[2]);
 	hdr->pid = ntohl(ints[3]);
+	hdr->weight = (format & PACKET_FORMAT_WEIGHTED) ? ntohl(ints[4]) : 1;
+	return 0;
 }
 
 void *write_header(void *base)
@@ -241,79 +1027,396 @@ void *write_header(void *base)
 	if (debug)
 		fprintf(stderr, "WRITING HEADER!\n");
 
-	bytes[0] = header.kernel;
+	bytes[0] = (format & PACKET_FORMAT_MULTIPID) ? 0 : header.kernel;
 	bytes[1] = header.counters;
 	bytes[2] = header.core;
-	bytes[3] = header.quantity;
+	bytes[3] = (format & PACKET_FORMAT_WIDE) ? 0 : (uint8_t)(header.quantity);
 	bytes += 4;
 
 	ints = (uint32_t *)(bytes);
+	if (format & PACKET_FORMAT_WIDE) {
+		ints[0] = htonl(header.quantity);
+		++ints;
+	}
 	ints[0] = htonl(header.batch);
 	ints[1] = htonl(header.missed);
 	ints[2] = htonl(header.first_index);
-	ints[3] = htonl(header.pid);
+	if (format & PACKET_FORMAT_MULTIPID)
+		ints[3] = htonl(nprocs);
+	else if (format & PACKET_FORMAT_PROCTABLE)
+		ints[3] = htonl(procs[0].id);
+	else
+		ints[3] = htonl(header.pid);
 	ints += 4;
+	if (format & PACKET_FORMAT_WEIGHTED)
+		*ints++ = htonl(header.weight);
 
 	return (void *)(ints);
 }
 
-void read_samples(void *base, struct sample *buf, struct packet_header *hdr)
+/*
+ * Fixed-width samples.  The plain loops take any counter count; the
+ * kernels below are specialized on it (and on WIDE) so every loop but
+ * the one over samples unrolls, and swap the counters' bytes 16 at a
+ * time with SSSE3 (if the CPU has it) or NEON.
+ */
+static void read_samples_loop(void *base, struct sample *buf, struct packet_header *hdr)
 {
 	uint32_t *ints = (uint32_t *)(base);
+	int wide = (format & PACKET_FORMAT_WIDE) ? 1 : 0;
 	uint32_t s = 0;
 	uint8_t c = 0;
 
 	for (s = 0; s < hdr->quantity; ++s) {
-		buf->cycles = ntohl(ints[0]);
+		if (wide)
+			buf->cycles = (unsigned long)(((uint64_t)(ntohl(ints[0])) << 32) | ntohl(ints[1]));
+		else
+			buf->cycles = ntohl(ints[0]);
 		buf->pid = hdr->pid;
-		for (c = 0; c < NUM_COUNTERS; ++c)
-			buf->counters[c] = ntohl(ints[c+1]);
-		ints += NUM_COUNTERS + 1;
+		for (c = 0; c < hdr->counters; ++c)
+			buf->counters[c] = ntohl(ints[1+wide+c]);
+		for (; c < PACKET_MAX_COUNTERS; ++c)
+			buf->counters[c] = 0;
+		ints += 1 + wide + hdr->counters;
 		++buf;
 	}
 }
 
-void *write_samples(void *base)
+static void *write_samples_loop(void *base)
 {
 	uint32_t *ints = (uint32_t *)(base);
+	int wide = (format & PACKET_FORMAT_WIDE) ? 1 : 0;
 	uint32_t s = 0;
 	uint8_t c = 0;
 
+	for (s = 0; s < header.quantity; ++s) {
+		if (wide) {
+			ints[0] = htonl((uint32_t)((uint64_t)(samples[s].cycles) >> 32));
+			ints[1] = htonl((uint32_t)(samples[s].cycles));
+		} else {
+			ints[0] = htonl(samples[s].cycles);
+		}
+		for (c = 0; c < header.counters; ++c)
+			ints[1+wide+c] = htonl(samples[s].counters[c]);
+		ints += 1 + wide + header.counters;
+	}
+	return (void *)(ints);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define SIMD_TARGET __attribute__((target("ssse3")))
+
+/* Reverses the bytes of each 32-bit lane */
+#define BSWAP32_MASK _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3)
+
+static inline SIMD_TARGET void swap4(const void *in, void *out)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)(in));
+	_mm_storeu_si128((__m128i *)(out), _mm_shuffle_epi8(v, BSWAP32_MASK));
+}
+
+static int simd_usable()
+{
+	return __builtin_cpu_supports("ssse3");
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_TARGET
+
+static inline void swap4(const void *in, void *out)
+{
+	vst1q_u8((uint8_t *)(out), vrev32q_u8(vld1q_u8((const uint8_t *)(in))));
+}
+
+static int simd_usable()
+{
+	return 1;
+}
+#endif
+
+/* Swap n (at most PACKET_MAX_COUNTERS) counters, vectors first with SIMD */
+template <int N, int SIMD>
+static inline void swap_counters(const uint32_t *in, uint32_t *out)
+{
+	int c = 0;
+
+#ifdef SIMD_TARGET
+	if (SIMD && N >= 4) {
+		swap4(in, out);
+		c = 4;
+	}
+#endif
+	for (; c < N; ++c)
+		out[c] = ntohl(in[c]);
+}
+
+template <int N, int WIDE, int SIMD>
+static inline void read_fixed(const uint32_t *ints, struct sample *buf,
+    size_t quantity, uint32_t pid)
+{
+	size_t s = 0;
+	int c = 0;
+
+	for (s = 0; s < quantity; ++s) {
+		if (WIDE)
+			buf->cycles = (unsigned long)(((uint64_t)(ntohl(ints[0])) << 32) | ntohl(ints[1]));
+		else
+			buf->cycles = ntohl(ints[0]);
+		buf->pid = pid;
+		swap_counters<N, SIMD>(ints + 1 + WIDE, buf->counters);
+		for (c = N; c < PACKET_MAX_COUNTERS; ++c)
+			buf->counters[c] = 0;
+		ints += 1 + WIDE + N;
+		++buf;
+	}
+}
+
+template <int N, int WIDE, int SIMD>
+static inline uint32_t *write_fixed(uint32_t *ints, const struct sample *buf,
+    size_t quantity)
+{
+	size_t s = 0;
+
+	for (s = 0; s < quantity; ++s) {
+		if (WIDE) {
+			ints[0] = htonl((uint32_t)((uint64_t)(buf[s].cycles) >> 32));
+			ints[1] = htonl((uint32_t)(buf[s].cycles));
+		} else {
+			ints[0] = htonl(buf[s].cycles);
+		}
+		swap_counters<N, SIMD>(buf[s].counters, ints + 1 + WIDE);
+		ints += 1 + WIDE + N;
+	}
+	return ints;
+}
+
+typedef void (*read_kernel)(const uint32_t *, struct sample *, size_t, uint32_t);
+typedef uint32_t *(*write_kernel)(uint32_t *, const struct sample *, size_t);
+
+template <int N, int WIDE>
+static void read_scalar(const uint32_t *ints, struct sample *buf, size_t quantity, uint32_t pid)
+{
+	read_fixed<N, WIDE, 0>(ints, buf, quantity, pid);
+}
+
+template <int N, int WIDE>
+static uint32_t *write_scalar(uint32_t *ints, const struct sample *buf, size_t quantity)
+{
+	return write_fixed<N, WIDE, 0>(ints, buf, quantity);
+}
+
+#ifdef SIMD_TARGET
+template <int N, int WIDE>
+static SIMD_TARGET void read_simd(const uint32_t *ints, struct sample *buf, size_t quantity, uint32_t pid)
+{
+	read_fixed<N, WIDE, 1>(ints, buf, quantity, pid);
+}
+
+template <int N, int WIDE>
+static SIMD_TARGET uint32_t *write_simd(uint32_t *ints, const struct sample *buf, size_t quantity)
+{
+	return write_fixed<N, WIDE, 1>(ints, buf, quantity);
+}
+#endif
+
+/* Kernels by [WIDE][counters]; SIMD ones replace the rest where they pay */
+#define KERNELS(k) { \
+	{ k<0, 0>, k<1, 0>, k<2, 0>, k<3, 0>, k<4, 0>, k<5, 0>, k<6, 0> }, \
+	{ k<0, 1>, k<1, 1>, k<2, 1>, k<3, 1>, k<4, 1>, k<5, 1>, k<6, 1> } }
+
+static read_kernel read_kernels[2][PACKET_MAX_COUNTERS + 1] = KERNELS(read_scalar);
+static write_kernel write_kernels[2][PACKET_MAX_COUNTERS + 1] = KERNELS(write_scalar);
+static int plain_loops = 0;
+
+static int use_simd_kernels()
+{
+#ifdef SIMD_TARGET
+	static const read_kernel simd_reads[2][PACKET_MAX_COUNTERS + 1] = KERNELS(read_simd);
+	static const write_kernel simd_writes[2][PACKET_MAX_COUNTERS + 1] = KERNELS(write_simd);
+	int w = 0;
+	int c = 0;
+
+	if (!simd_usable())
+		return 0;
+	for (w = 0; w < 2; ++w) {
+		for (c = 4; c <= PACKET_MAX_COUNTERS; ++c) {
+			read_kernels[w][c] = simd_reads[w][c];
+			write_kernels[w][c] = simd_writes[w][c];
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Once, before the first kernel runs (readers may be on several threads) */
+static void pick_kernels()
+{
+	static int simd = use_simd_kernels();
+	(void)(simd);
+}
+
+void packet_use_plain_loops(int plain)
+{
+	plain_loops = plain;
+}
+
+void read_samples(void *base, struct sample *buf, struct packet_header *hdr)
+{
+	int wide = (format & PACKET_FORMAT_WIDE) ? 1 : 0;
+
+	if (plain_loops) {
+		read_samples_loop(base, buf, hdr);
+		return;
+	}
+	pick_kernels();
+	read_kernels[wide][hdr->counters]((const uint32_t *)(base), buf, hdr->quantity, hdr->pid);
+}
+
+void *write_samples(void *base)
+{
+	int wide = (format & PACKET_FORMAT_WIDE) ? 1 : 0;
+
 	if (debug)
 		fprintf(stderr, "WRITING %zu SAMPLES!\n", (size_t)(header.quantity));
 
+	if (plain_loops)
+		return write_samples_loop(base);
+	pick_kernels();
+	return write_kernels[wide][header.counters]((uint32_t *)(base), samples, header.quantity);
+}
+
+/*
+ * Columnar (v2) sample encoding: each column -- cycles, then each
+ * counter -- holds the zigzag encoded difference from the previous
+ * sample's value (the first against zero) as an LEB128 varint.
+ */
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)(v) << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)((v >> 1) ^ (~(v & 1) + 1));
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v) | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)(v);
+	return p;
+}
+
+/*
+ * Read the varint at *p, moving *p past it.  Returns 0, 1 if it runs
+ * past end, or -1 if it is longer than any 64-bit value needs.
+ */
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	const uint8_t *q = *p;
+	uint64_t x = 0;
+	unsigned shift = 0;
+
+	/* Most deltas fit in a byte */
+	if (q < end && *q < 0x80) {
+		*v = *q;
+		*p = q + 1;
+		return 0;
+	}
+	for (; q < end && shift < 64; shift += 7) {
+		uint8_t byte = *q++;
+		x |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = x;
+			*p = q;
+			return 0;
+		}
+	}
+	return shift < 64 ? 1 : -1;
+}
+
+/* Decode the columns at base; returns as get_varint, setting *read */
+int read_columns(void *base, void *end, struct sample *buf, struct packet_header *hdr,
+    size_t *read)
+{
+	const uint8_t *p = (const uint8_t *)(base);
+	const uint8_t *e = (const uint8_t *)(end);
+	uint64_t prev = 0;
+	uint64_t v = 0;
+	uint32_t s = 0;
+	uint8_t c = 0;
+	int rc = 0;
+
+	for (s = 0; s < hdr->quantity; ++s) {
+		if ((rc = get_varint(&p, e, &v)))
+			return rc;
+		prev += unzigzag(v);
+		buf[s].cycles = prev;
+		buf[s].pid = hdr->pid;
+	}
+	for (c = 0; c < hdr->counters; ++c) {
+		prev = 0;
+		for (s = 0; s < hdr->quantity; ++s) {
+			if ((rc = get_varint(&p, e, &v)))
+				return rc;
+			prev += unzigzag(v);
+			buf[s].counters[c] = (uint32_t)(prev);
+		}
+	}
+	for (; c < PACKET_MAX_COUNTERS; ++c) {
+		for (s = 0; s < hdr->quantity; ++s)
+			buf[s].counters[c] = 0;
+	}
+	*read = p - (const uint8_t *)(base);
+	return 0;
+}
+
+void *write_columns(void *base)
+{
+	uint8_t *p = (uint8_t *)(base);
+	uint64_t prev = 0;
+	uint32_t s = 0;
+	uint8_t c = 0;
+
+	if (debug)
+		fprintf(stderr, "WRITING %zu SAMPLES IN COLUMNS!\n", (size_t)(header.quantity));
+
 	for (s = 0; s < header.quantity; ++s) {
-		ints[0] = htonl(samples[s].cycles);
-		for (c = 0; c < NUM_COUNTERS; ++c)
-			ints[1+c] = htonl(samples[s].counters[c]);
-		ints += NUM_COUNTERS + 1;
+		p = put_varint(p, zigzag((int64_t)(samples[s].cycles - prev)));
+		prev = samples[s].cycles;
 	}
-	return (void *)(ints);
+	for (c = 0; c < header.counters; ++c) {
+		prev = 0;
+		for (s = 0; s < header.quantity; ++s) {
+			p = put_varint(p, zigzag((int64_t)(samples[s].counters[c] - prev)));
+			prev = samples[s].counters[c];
+		}
+	}
+	return (void *)(p);
 }
 
 int read_info(char *ptr, size_t n, char **cmdline, char **exe, size_t *read)
 {
-	*cmdline = ptr;
-	for (; n && *ptr; --n) {
-		++ptr;
-		++*read;
-	}
+	char *end = (char *)(memchr(ptr, '\0', n));
 
-	--n;
-	if (!n)
+	if (!end)
 		return 1;
-	++ptr;
-	++*read;
+	*cmdline = ptr;
+	*read += end + 1 - ptr;
+	n -= end + 1 - ptr;
+	ptr = end + 1;
 
+	end = (char *)(memchr(ptr, '\0', n));
+	if (!end)
+		return 1;
 	*exe = ptr;
-	for (; n && *ptr; --n) {
-		++ptr;
-		++*read;
-	}
-
-	--n;
-	++ptr;
-	++*read;
+	*read += end + 1 - ptr;
 
 	return 0;
 }
@@ -322,20 +1425,74 @@ int read_info(char *ptr, size_t n, char **cmdline, char **exe, size_t *read)
 void *write_info(void *base)
 {
 	uint8_t *bytes = (uint8_t *)(base);
-	size_t cmdlen = strlen(info.cmdline);
-	size_t exelen = strlen(info.exe);
+	size_t i = 0;
+
+	if (format & PACKET_FORMAT_PROCTABLE)
+		return base;
 
 	if (debug)
 		fprintf(stderr, "WRITING INFO!\n");
 
-	memcpy(bytes, info.cmdline, cmdlen+1);
-	bytes += cmdlen+1;
-	memcpy(bytes, info.exe, exelen+1);
-	bytes += exelen+1;
+	for (i = 0; i < nprocs; ++i) {
+		size_t cmdlen = strlen(procs[i].cmdline);
+		size_t exelen = strlen(procs[i].exe);
+
+		memcpy(bytes, procs[i].cmdline, cmdlen+1);
+		bytes += cmdlen+1;
+		memcpy(bytes, procs[i].exe, exelen+1);
+		bytes += exelen+1;
+	}
 
 	return (void *)(bytes);
 }
 
+/*
+ * MULTIPID dictionary:  one UINT per process (pid, or process-table id,
+ * with the top bit set for kernel threads), then one byte per sample
+ * indexing it, padded to a multiple of four.
+ */
+void *write_dictionary(void *base)
+{
+	uint32_t *ints = (uint32_t *)(base);
+	uint8_t *bytes = NULL;
+	size_t i = 0;
+
+	if (debug)
+		fprintf(stderr, "WRITING DICTIONARY OF %zu PROCESSES!\n", nprocs);
+
+	for (i = 0; i < nprocs; ++i) {
+		uint32_t value = (format & PACKET_FORMAT_PROCTABLE) ? procs[i].id : procs[i].pid;
+		ints[i] = htonl(value | (procs[i].kernel ? 0x80000000U : 0));
+	}
+
+	bytes = (uint8_t *)(ints + nprocs);
+	memcpy(bytes, &sample_proc[0], header.quantity);
+	memset(bytes + header.quantity, 0, pad4(header.quantity) - header.quantity);
+	return (void *)(bytes + pad4(header.quantity));
+}
+
+void *read_dictionary(void *base, struct packet_header *hdr)
+{
+	uint32_t *ints = (uint32_t *)(base);
+	uint8_t *bytes = (uint8_t *)(ints + hdr->pid);
+	size_t i = 0;
+
+	read_nprocs = hdr->pid;
+	for (i = 0; i < read_nprocs; ++i) {
+		uint32_t value = ntohl(ints[i]);
+		read_procs[i].pid = value & 0x7fffffffU;
+		read_procs[i].kernel = (value & 0x80000000U) ? 1 : 0;
+		read_procs[i].cmdline = "";
+		read_procs[i].exe = "";
+	}
+	for (i = 0; i < hdr->quantity; ++i) {
+		if (bytes[i] >= read_nprocs)
+			return NULL;
+		read_index[i] = bytes[i];
+	}
+	return (void *)(bytes + pad4(hdr->quantity));
+}
+
 void initialize()
 {
 	if (initialized)
@@ -346,7 +1503,8 @@ void initialize()
 
 	memset(&header, 0, sizeof(packet_header));
 	memset(&memory, 0, sizeof(memory));
-	memset(&info, 0, sizeof(info));
-	memset(&samples[0], 0, sizeof(struct sample) * 256);
+	memset(&procs[0], 0, sizeof(procs));
+	memset(&samples[0], 0, sizeof(samples));
+	nprocs = 0;
 	initialized = 1;
 }
@@ -7,34 +7,200 @@
 
 #include "sample_buffer.h"
 
+/* Largest packet packet_read can return (only WIDE streams exceed 255) */
+#define PACKET_MAX_SAMPLES (4096)
+
+/* Counters a struct sample has room for */
+#define PACKET_MAX_COUNTERS (6)
+
 struct packet_header {
         uint8_t kernel;
         uint8_t counters;
         uint8_t core;
-        uint8_t quantity;
+        uint16_t quantity;
 
         uint32_t batch;
-        uint32_t missed;		/* WARNING:  Constant across batch! */
+        uint32_t missed;		/* Samples lost on this core so far */
         uint32_t first_index;
         uint32_t pid;
+        uint32_t weight;		/* Samples each one stands for (1 unless WEIGHTED) */
+};
+
+/*
+ * Stream format flags.  The sender announces them in the experiment info
+ * as a "format:  <flags>" line; streams without one are format 0.
+ *
+ *   PACKET_FORMAT_COLUMNAR  -- samples are stored column by column as
+ *                              zigzag varint deltas (see protocol.txt)
+ *   PACKET_FORMAT_PROCTABLE -- cmdline and exe travel once, in process
+ *                              records; packets carry a process id
+ *   PACKET_FORMAT_MULTIPID  -- a packet may hold samples of many pids,
+ *                              with a small per-packet dictionary
+ *   PACKET_FORMAT_WIDE      -- 64-bit cycles and up to PACKET_MAX_SAMPLES
+ *                              samples per packet
+ *   PACKET_FORMAT_WEIGHTED  -- the header carries a weight:  how many
+ *                              samples each one in the packet stands for
+ *   PACKET_FORMAT_AGGREGATE -- the stream holds aggregate records:  per
+ *                              pid and core sums over an interval
+ *                              (always with PROCTABLE)
+ *
+ * Whatever the format, each sample carries exactly as many counters as
+ * the header's counters byte says.
+ */
+#define PACKET_FORMAT_COLUMNAR (0x1)
+#define PACKET_FORMAT_PROCTABLE (0x2)
+#define PACKET_FORMAT_MULTIPID (0x4)
+#define PACKET_FORMAT_WIDE (0x8)
+#define PACKET_FORMAT_WEIGHTED (0x10)
+#define PACKET_FORMAT_AGGREGATE (0x20)
+
+/* Byte 0 of the other records (byte 0 of a packet is the kernel flag) */
+#define PACKET_RECORD_PROCESS (0x80)
+#define PACKET_RECORD_AGGREGATE (0x81)
+#define PACKET_RECORD_RETIRE (0x82)
+
+/* The interval an aggregate record covers */
+struct packet_interval {
+	uint32_t number;	/* Counts up from 0 */
+	uint64_t start_ms;	/* Wall clock, ms since the epoch */
+	uint32_t length_ms;
+	uint32_t missed;	/* Samples lost on all cores, at the interval's end */
+	uint8_t counters;	/* Sums per entry */
+	uint32_t quantity;	/* Entries */
+};
+
+/* Sums over one pid's samples on one core */
+struct packet_aggregate {
+	uint32_t pid;
+	uint32_t id;		/* Process-table id; the sender fills this in */
+	uint8_t core;
+	uint8_t kernel;
+	uint32_t samples;
+	uint64_t cycles;
+	uint64_t sums[PACKET_MAX_COUNTERS];
+	const char *cmdline;	/* Filled in by packet_read */
+	const char *exe;
 };
 
+/* Select the format used by packet_create and packet_read. */
+void packet_set_format(uint32_t format);
+uint32_t packet_get_format();
+
+/*
+ * Decoding state of one stream:  its format and process table.  A
+ * reader following several streams at once keeps one per stream and
+ * selects it before packet_set_format or packet_read on that stream's
+ * bytes; NULL selects the default stream everything else uses.  Not
+ * thread safe:  one thread decodes at a time.
+ */
+struct packet_stream;
+struct packet_stream *packet_stream_new();
+void packet_stream_free(struct packet_stream *s);
+void packet_stream_select(struct packet_stream *s);
+
+/* Set how many counters the sender encodes per sample (default 6). */
+void packet_set_counters(uint8_t counters);
+
+/*
+ * Weight of the samples appended from now on (default 1).  A change of
+ * weight starts a new packet; see packet_should_create.
+ */
+void packet_set_weight(uint32_t weight);
+
+/* Pull the format flags out of the experiment info (0 if absent). */
+uint32_t packet_parse_format(const char *info);
+
+/*
+ * Turn a comma separated list of format names ("columnar", ...) into
+ * flags.  Returns 0 and sets *format on success, -1 on an unknown name.
+ */
+int packet_format_by_name(const char *names, uint32_t *format);
+
 /*
  * Read a packet from a source using network byte order.
  * Arguments:
  *    bytes -- the data read from the network
  *    n -- the number of bytes in bytes
  *    hdr -- where to read the header into
- *    buf -- where to read samples into (should be at least 256 samples long)
+ *    buf -- where to read samples into (at least PACKET_MAX_SAMPLES long)
  *    cmdline -- this will be set to where the cmdline starts IN BYTES
  *    exe -- this will be set to where the exe starts IN BYTES
  *    read -- number of bytes read
  *
- * Returns 0 if everything went okay or 1 if more bytes are needed
+ * Returns 0 if everything went okay or 1 if more bytes are needed.
+ * Returns 2 if a process or retire record was consumed instead of a
+ * packet; skip *read bytes and carry on.  Returns 3 if it was an aggregate record;
+ * get at it with packet_aggregates, then skip *read bytes.  Returns -1
+ * if the data is malformed.
+ *
+ * In PROCTABLE streams, hdr->pid and the samples' pid are translated
+ * back to the real pid and cmdline/exe point at the process table, so
+ * callers see the same thing either way.
+ *
+ * MULTIPID packets mix processes.  Each sample's pid is filled in, and
+ * hdr, cmdline and exe describe the first sample's process; use
+ * packet_run to walk the packet one process at a time.
  */
 int packet_read(void *bytes, size_t n, struct packet_header *hdr,
     struct sample *buf, char **cmdline, char **exe, size_t *read);
 
+/*
+ * Find where the record at bytes ends without decoding it, for indexing
+ * a stream:  returns what packet_read would and sets *read, but only
+ * process records are taken in (into the process table).  Once a
+ * stretch of the stream has been skipped, its packets and aggregate
+ * records may be packet_read by several threads at once; each thread
+ * gets its own results.  Don't packet_read process records meanwhile.
+ * The ids retire records free are only dropped by packet_retire_skipped.
+ */
+int packet_skip(void *bytes, size_t n, size_t *read);
+
+/*
+ * Drop the processes retired by the records packet_skip and packet_peek
+ * went past.  Call it once the packets skipped over have been read.
+ */
+void packet_retire_skipped();
+
+/*
+ * packet_skip that also fills in *hdr, *cmdline and *exe for a packet as
+ * packet_read would, but leaves the samples undecoded:  enough to decide
+ * whether a packet is worth reading.
+ */
+int packet_peek(void *bytes, size_t n, struct packet_header *hdr,
+    char **cmdline, char **exe, size_t *read);
+
+/*
+ * The aggregate record packet_read returned 3 for last:  fills in *iv
+ * and returns its iv->quantity entries, valid until the next read.
+ */
+const struct packet_aggregate *packet_aggregates(struct packet_interval *iv);
+
+/*
+ * Build an aggregate record of n entries (with ids set) for interval
+ * *iv, with as many sums per entry as packets have counters (so
+ * iv->counters is ignored).  Same memory rules as packet_create.
+ */
+int packet_aggregate_record(const struct packet_interval *iv,
+    const struct packet_aggregate *entries, size_t n, void **save, size_t *bytes);
+
+/* A process referenced by a packet */
+struct packet_process {
+	uint32_t pid;
+	uint8_t kernel;
+	const char *cmdline;
+	const char *exe;
+};
+
+/*
+ * Split the packet packet_read returned last into runs of samples from
+ * one process.  Starting from sample `start', fill in *run as the header
+ * such a single-process packet would have had (pid, kernel, quantity and
+ * first_index adjusted) along with its cmdline and exe, and return the
+ * number of samples in the run.  Other packets are a single run.
+ */
+size_t packet_run(const struct packet_header *hdr, size_t start,
+    struct packet_header *run, char **cmdline, char **exe);
+
 
 /*
  * If the given arguments would result in a different packet header
@@ -43,9 +209,39 @@ int packet_read(void *bytes, size_t n, struct packet_header *hdr,
  */
 int packet_should_create(struct buffer& b, struct sample& s, struct ProcessInfo& pi);
 
+/*
+ * In PROCTABLE streams, create the process record announcing pi if the
+ * reader has not been told about this generation of it.  *save is left
+ * NULL when nothing needs to be sent.  The record must be sent before
+ * any packet holding pi's samples.  Same memory rules as packet_create.
+ */
+int packet_process_record(struct ProcessInfo& pi, void **save, size_t *bytes);
+
+/*
+ * Let the reader forget pi's id:  pi is about to be dropped.  (A new
+ * generation retires the old id by itself.)
+ */
+void packet_retire(struct ProcessInfo& pi);
+
+/*
+ * Create a retire record for every id retired since the last one; *save
+ * is left NULL when there are none.  Send it only after every packet and
+ * aggregate record using those ids.  Same memory rules as packet_create.
+ */
+int packet_retire_record(void **save, size_t *bytes);
+
+/* The ids of the retire record created last; good until the next one */
+size_t packet_retired(const uint32_t **ids);
+
 /* Return whether a the current packet is empty. */
 int packet_empty();
 
+/*
+ * Return whether pid's ProcessInfo may be reloaded, i.e. the packet
+ * being built does not point at its strings.
+ */
+int packet_can_refresh(uint32_t pid);
+
 /*
  * Create a packet from the current state.
  * Returns 0 if everything went okay, and -1 if there was an error.
@@ -74,4 +270,11 @@ void packet_clean();
 /* Set debugging on */
 void packet_set_debug();
 
+/*
+ * Encode and decode fixed-width samples with the plain per-counter loops
+ * instead of the kernels specialized on the counter count (for
+ * comparison; see packet_bench).
+ */
+void packet_use_plain_loops(int plain);
+
 #endif
@@ -0,0 +1,242 @@
+
+/*
+ * Encode synthetic sample buffers in every wire format and report the
+ * bytes and time spent per sample.  Then time the fixed-width sample
+ * kernels against the plain per-counter loops, in GB/s of packets.
+ *
+ * Usage:  packet_bench [pids] [run length] [buffers]
+ *
+ * Consecutive samples cycle through `pids' processes, switching every
+ * `run length' samples, like several busy threads sharing a core.
+ * Formats named /4 only encode the four counters the samples use.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "network.h"
+#include "packet.h"
+#include "sample_buffer.h"
+
+static const struct {
+	const char *name;
+	uint32_t format;
+	uint8_t counters;
+} formats[] = {
+	{ "legacy", 0, 6 },
+	{ "columnar", PACKET_FORMAT_COLUMNAR, 6 },
+	{ "proctable", PACKET_FORMAT_PROCTABLE, 6 },
+	{ "multipid", PACKET_FORMAT_MULTIPID, 6 },
+	{ "multipid,proctable", PACKET_FORMAT_MULTIPID | PACKET_FORMAT_PROCTABLE, 6 },
+	{ "all", PACKET_FORMAT_COLUMNAR | PACKET_FORMAT_PROCTABLE | PACKET_FORMAT_MULTIPID, 6 },
+	{ "legacy/4", 0, 4 },
+	{ "wide/4", PACKET_FORMAT_WIDE, 4 },
+	{ "all,wide/4", PACKET_FORMAT_COLUMNAR | PACKET_FORMAT_PROCTABLE |
+	    PACKET_FORMAT_MULTIPID | PACKET_FORMAT_WIDE, 4 },
+};
+
+/* Formats whose samples the kernels handle */
+static const struct {
+	const char *name;
+	uint32_t format;
+	uint8_t counters;
+} fixed[] = {
+	{ "legacy/4", 0, 4 },
+	{ "legacy", 0, 6 },
+	{ "wide/4", PACKET_FORMAT_WIDE, 4 },
+	{ "wide", PACKET_FORMAT_WIDE, 6 },
+};
+
+/* Times the packets of the buffers are decoded over in the kernel test */
+#define DECODE_ROUNDS (20)
+
+struct tally {
+	size_t bytes;
+	size_t packets;
+};
+
+static int count_sink(void *packet, size_t bytes, size_t *sent, void *arg)
+{
+	struct tally *t = (struct tally *)(arg);
+
+	(void)(packet);
+	t->bytes += bytes;
+	++t->packets;
+	if (sent)
+		*sent = bytes;
+	return 0;
+}
+
+static int keep_sink(void *packet, size_t bytes, size_t *sent, void *arg)
+{
+	std::vector<char> *stream = (std::vector<char> *)(arg);
+
+	stream->insert(stream->end(), (char *)(packet), (char *)(packet) + bytes);
+	if (sent)
+		*sent = bytes;
+	return 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill(std::vector<struct buffer>& buffers, unsigned pids, unsigned run)
+{
+	unsigned long base = getpid();
+	size_t i = 0, j = 0;
+	unsigned c = 0;
+
+	srand(1);
+	for (i = 0; i < buffers.size(); ++i) {
+		struct buffer &b = buffers[i];
+
+		b.core = i % 4;
+		b.num_samples = BUFFER_ENTRIES;
+		b.nextBuffer = NULL;
+		for (j = 0; j < BUFFER_ENTRIES; ++j) {
+			struct sample &s = b.samples[j];
+			s.pid = base + ((i * BUFFER_ENTRIES + j) / run) % pids;
+			s.cycles = 100000 + rand() % 2000;
+			for (c = 0; c < 6; ++c)
+				s.counters[c] = (c < 4) ? 5000 + rand() % 500 : 0;
+		}
+	}
+}
+
+static int encode_all(std::vector<struct buffer>& buffers, struct tally *t)
+{
+	size_t i = 0;
+
+	for (i = 0; i < buffers.size(); ++i) {
+		if (network_encode(buffers[i], 0, count_sink, t, NULL))
+			return -1;
+	}
+	return 0;
+}
+
+/* Seconds to packet_read the stream `rounds' times, or -1 if it fails */
+static double decode_all(std::vector<char>& stream, int rounds)
+{
+	static struct sample out[PACKET_MAX_SAMPLES];
+	struct packet_header hdr;
+	double start = now();
+	char *cmdline = NULL;
+	char *exe = NULL;
+	size_t at = 0;
+	size_t n = 0;
+	int r = 0;
+
+	for (r = 0; r < rounds; ++r) {
+		for (at = 0; at < stream.size(); at += n) {
+			if (packet_read(&stream[at], stream.size() - at, &hdr, out,
+			    &cmdline, &exe, &n))
+				return -1;
+		}
+	}
+	return now() - start;
+}
+
+/* The kernels against the plain loops, on full single-pid packets */
+static int time_kernels(std::vector<struct buffer>& buffers)
+{
+	size_t f = 0;
+	size_t i = 0;
+	int plain = 0;
+
+	fill(buffers, 1, 1);
+	printf("\n%-20s %12s %12s %12s %12s   (GB/s)\n", "format",
+	    "decode loop", "decode", "encode loop", "encode");
+
+	for (f = 0; f < sizeof(fixed) / sizeof(fixed[0]); ++f) {
+		std::vector<char> stream;
+		struct tally t;
+		double gbs[2][2];
+
+		packet_set_format(fixed[f].format);
+		packet_set_counters(fixed[f].counters);
+		for (i = 0; i < buffers.size(); ++i) {
+			if (network_encode(buffers[i], 0, keep_sink, &stream, NULL))
+				return -1;
+		}
+
+		for (plain = 1; plain >= 0; --plain) {
+			double decode = 0;
+			double start = 0;
+
+			packet_use_plain_loops(plain);
+			decode = decode_all(stream, DECODE_ROUNDS);
+			if (decode < 0)
+				return -1;
+			gbs[plain][0] = stream.size() * (double)(DECODE_ROUNDS) / decode / 1e9;
+
+			memset(&t, 0, sizeof(t));
+			start = now();
+			if (encode_all(buffers, &t))
+				return -1;
+			gbs[plain][1] = t.bytes / (now() - start) / 1e9;
+		}
+		packet_use_plain_loops(0);
+
+		printf("%-20s %12.2f %12.2f %12.2f %12.2f\n", fixed[f].name,
+		    gbs[1][0], gbs[0][0], gbs[1][1], gbs[0][1]);
+	}
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	unsigned pids = argc > 1 ? atoi(argv[1]) : 8;
+	unsigned run = argc > 2 ? atoi(argv[2]) : 2;
+	size_t count = argc > 3 ? atoi(argv[3]) : 2000;
+	std::vector<struct buffer> buffers(count);
+	size_t samples = count * BUFFER_ENTRIES;
+	size_t f = 0;
+
+	if (!pids || !run || !count) {
+		fprintf(stderr, "Usage:  %s [pids] [run length] [buffers]\n", argv[0]);
+		return -1;
+	}
+
+	fill(buffers, pids, run);
+	printf("%zu samples, %u pids, switching every %u samples\n", samples, pids, run);
+	printf("%-20s %12s %12s %14s\n", "format", "bytes/sample", "ns/sample", "samples/packet");
+
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		struct tally t;
+		double start = 0;
+		double elapsed = 0;
+
+		packet_set_format(formats[f].format);
+		packet_set_counters(formats[f].counters);
+
+		/* First pass fills the process cache and sends process records */
+		memset(&t, 0, sizeof(t));
+		if (encode_all(buffers, &t))
+			return -1;
+
+		memset(&t, 0, sizeof(t));
+		start = now();
+		if (encode_all(buffers, &t))
+			return -1;
+		elapsed = now() - start;
+
+		printf("%-20s %12.2f %12.1f %14.1f\n", formats[f].name,
+		    (double)(t.bytes) / samples, elapsed * 1e9 / samples,
+		    (double)(samples) / t.packets);
+	}
+
+	if (time_kernels(buffers))
+		return -1;
+
+	packet_clean();
+	return 0;
+}
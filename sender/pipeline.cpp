@@ -0,0 +1,338 @@
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "network.h"
+#include "pipeline.h"
+#include "spsc_queue.h"
+#include "stats.h"
+
+struct raw_item {
+	struct buffer *b;	/* NULL marks the end of the stream */
+	uint32_t dropped;	/* Samples dropped on b's core since its last item */
+};
+
+struct chunk {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct stage_stats {
+	size_t items;
+	size_t depth_sum;
+	size_t depth_max;
+	size_t stalls;		/* Times the stage had to wait for space */
+};
+
+static struct {
+	const struct pipeline_config *config;
+
+	spsc_queue<raw_item> *raw;		/* device -> encoder */
+	spsc_queue<struct buffer *> *free_buffers;	/* encoder -> device */
+	spsc_queue<struct chunk *> *out;	/* encoder -> network */
+	spsc_queue<struct chunk *> *free_chunks;	/* network -> encoder */
+
+	struct chunk *current;		/* Chunk the encoder is filling */
+
+	std::atomic<int> stop;		/* Set when any stage wants out */
+	std::atomic<int> failed;
+
+	struct stage_stats device, encoder, network;
+	size_t dropped;			/* Samples drained without a buffer */
+	uint32_t unsent[256];		/* ... and what they lost, per core, not yet passed on */
+	size_t outbytes;
+} pl;
+
+static void wait_a_bit(unsigned *spins)
+{
+	struct timespec ts = {0, 50000};
+
+	if (++*spins < 64)
+		return;
+	if (*spins < 128) {
+		sched_yield();
+		return;
+	}
+	nanosleep(&ts, NULL);
+}
+
+static void note_depth(struct stage_stats *st, size_t depth)
+{
+	++st->items;
+	st->depth_sum += depth;
+	if (depth > st->depth_max)
+		st->depth_max = depth;
+}
+
+static struct chunk *grab_chunk()
+{
+	struct chunk *c = NULL;
+	unsigned spins = 0;
+
+	while (!pl.free_chunks->pop(c)) {
+		if (pl.stop.load(std::memory_order_relaxed))
+			return NULL;
+		if (!spins)
+			++pl.encoder.stalls;
+		wait_a_bit(&spins);
+	}
+	c->len = 0;
+	return c;
+}
+
+/* Hand a chunk (or the NULL end marker) over to the network stage. */
+static int push_chunk(struct chunk *c)
+{
+	unsigned spins = 0;
+
+	while (!pl.out->push(c)) {
+		if (c && pl.stop.load(std::memory_order_relaxed))
+			return -1;
+		if (!spins)
+			++pl.encoder.stalls;
+		wait_a_bit(&spins);
+	}
+	note_depth(&pl.encoder, pl.out->size());
+	stats_set(STAT_OUT_QUEUE, pl.out->size());
+	return 0;
+}
+
+static int flush_chunk()
+{
+	struct chunk *c = pl.current;
+
+	if (!c || !c->len)
+		return 0;
+	pl.current = NULL;
+	return push_chunk(c);
+}
+
+static int chunk_sink(void *packet, size_t bytes, size_t *sent, void *arg)
+{
+	struct chunk *c = pl.current;
+
+	(void)(arg);
+	if (c && c->cap - c->len < bytes) {
+		if (flush_chunk())
+			return -1;
+		c = NULL;
+	}
+	if (!c) {
+		c = pl.current = grab_chunk();
+		if (!c)
+			return -1;
+	}
+	/* A single packet bigger than a chunk (huge cmdline); just grow it. */
+	if (c->cap < bytes) {
+		char *data = (char *)(realloc(c->data, bytes));
+		if (!data)
+			return -1;
+		c->data = data;
+		c->cap = bytes;
+	}
+
+	memcpy(c->data + c->len, packet, bytes);
+	c->len += bytes;
+	if (sent)
+		*sent = bytes;
+	return 0;
+}
+
+static void encoder_stage()
+{
+	const struct pipeline_config *config = pl.config;
+	struct raw_item item;
+	unsigned spins = 0;
+
+	for (;;) {
+		if (!pl.raw->pop(item)) {
+			/* Nothing waiting, so don't sit on a partial chunk. */
+			if (flush_chunk())
+				break;
+			wait_a_bit(&spins);
+			continue;
+		}
+		spins = 0;
+		if (!item.b)
+			break;
+
+		if (!pl.stop.load(std::memory_order_relaxed)) {
+			if (network_encode(*item.b, item.dropped, chunk_sink, NULL, NULL))
+				pl.stop = 1;
+			else if (config->inspect)
+				config->inspect(*item.b);
+		}
+
+		/* The pool is sized to fit in free_buffers, so this can't fail. */
+		pl.free_buffers->push(item.b);
+	}
+
+	flush_chunk();
+	push_chunk(NULL);
+}
+
+static void network_stage()
+{
+	const struct pipeline_config *config = pl.config;
+	struct chunk *c = NULL;
+	unsigned spins = 0;
+	size_t sent = 0;
+
+	for (;;) {
+		if (!pl.out->pop(c)) {
+			wait_a_bit(&spins);
+			continue;
+		}
+		spins = 0;
+		if (!c)
+			break;
+
+		if (!pl.stop.load(std::memory_order_relaxed)) {
+			note_depth(&pl.network, pl.out->size());
+			if (network_packet(c->data, c->len, &sent)) {
+				fprintf(stderr, "error:  Could not send chunk:  %s\n", strerror(errno));
+				pl.failed = 1;
+				pl.stop = 1;
+			} else {
+				pl.outbytes += sent;
+				if (config->kbytes > 0 && pl.outbytes / 1000 > config->kbytes) {
+					fprintf(stderr, "%zu kb requested, %zu bytes sent.\n",
+					    config->kbytes, pl.outbytes);
+					pl.stop = 1;
+				}
+			}
+		}
+
+		pl.free_chunks->push(c);
+	}
+}
+
+/* Buffers read while the pool is empty are drained into scratch and dropped. */
+static void device_stage(FILE *f, struct buffer *scratch)
+{
+	struct buffer *b = NULL;
+	struct raw_item item;
+	unsigned spins = 0;
+
+	while (!feof(f) && !pl.stop.load(std::memory_order_relaxed)) {
+		int have = pl.free_buffers->pop(b);
+		struct buffer *into = have ? b : scratch;
+		uint64_t started = stats_now();
+
+		if (fread(into, sizeof(struct buffer), 1, f) != 1)
+			break;
+		stats_time(STAT_READ_NS, stats_now() - started);
+		stats_add(STAT_DEVICE_READS, 1);
+		stats_add(STAT_DEVICE_BYTES, sizeof(struct buffer));
+		stats_add(STAT_KERNEL_MISSED, into->missed);
+
+		if (!have) {
+			/* Encoder is behind; keep the kernel drained regardless. */
+			++pl.device.stalls;
+			pl.dropped += into->num_samples;
+			pl.unsent[(uint8_t)(into->core)] += into->num_samples + into->missed;
+			stats_add(STAT_DROPPED, into->num_samples);
+			continue;
+		}
+
+		item.b = b;
+		item.dropped = pl.unsent[(uint8_t)(b->core)];
+		pl.unsent[(uint8_t)(b->core)] = 0;
+		while (!pl.raw->push(item))
+			wait_a_bit(&spins);
+		spins = 0;
+		note_depth(&pl.device, pl.raw->size());
+		stats_set(STAT_RAW_QUEUE, pl.raw->size());
+	}
+
+	item.b = NULL;
+	item.dropped = 0;
+	while (!pl.raw->push(item))
+		wait_a_bit(&spins);
+}
+
+static void print_stage(const char *name, const struct stage_stats *st, size_t cap)
+{
+	fprintf(stderr, "  %-8s %10zu items, queue avg %6.1f max %4zu of %4zu, %zu stalls\n",
+	    name, st->items,
+	    st->items ? (double)(st->depth_sum) / st->items : 0.0,
+	    st->depth_max, cap, st->stalls);
+}
+
+void pipeline_default_config(struct pipeline_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->buffers = 256;
+	config->chunks = 64;
+	config->chunk_size = 256 * 1024;
+}
+
+int pipeline_run(FILE *device, const struct pipeline_config *config)
+{
+	std::vector<struct buffer> buffers(config->buffers);
+	std::vector<struct chunk> chunks(config->chunks);
+	struct buffer *scratch = NULL;
+	size_t i = 0;
+
+	spsc_queue<raw_item> raw(config->buffers);
+	spsc_queue<struct buffer *> free_buffers(config->buffers);
+	spsc_queue<struct chunk *> out(config->chunks + 1);
+	spsc_queue<struct chunk *> free_chunks(config->chunks);
+
+	scratch = (struct buffer *)(malloc(sizeof(struct buffer)));
+	if (!scratch) {
+		fprintf(stderr, "error:  Could not allocate the device scratch buffer.\n");
+		return -1;
+	}
+
+	memset(&pl.device, 0, sizeof(pl.device));
+	memset(&pl.encoder, 0, sizeof(pl.encoder));
+	memset(&pl.network, 0, sizeof(pl.network));
+	pl.config = config;
+	pl.raw = &raw;
+	pl.free_buffers = &free_buffers;
+	pl.out = &out;
+	pl.free_chunks = &free_chunks;
+	pl.current = NULL;
+	pl.stop = 0;
+	pl.failed = 0;
+	pl.dropped = 0;
+	memset(&pl.unsent[0], 0, sizeof(pl.unsent));
+	pl.outbytes = 0;
+
+	for (i = 0; i < buffers.size(); ++i)
+		free_buffers.push(&buffers[i]);
+	for (i = 0; i < chunks.size(); ++i) {
+		chunks[i].data = (char *)(malloc(config->chunk_size));
+		chunks[i].cap = chunks[i].data ? config->chunk_size : 0;
+		chunks[i].len = 0;
+		free_chunks.push(&chunks[i]);
+	}
+
+	std::thread encoder(encoder_stage);
+	std::thread network(network_stage);
+	device_stage(device, scratch);
+	encoder.join();
+	network.join();
+
+	for (i = 0; i < chunks.size(); ++i)
+		free(chunks[i].data);
+	free(scratch);
+
+	fprintf(stderr, "Pipeline statistics:\n");
+	print_stage("device", &pl.device, raw.capacity());
+	print_stage("encoder", &pl.encoder, out.capacity());
+	print_stage("network", &pl.network, out.capacity());
+	fprintf(stderr, "  %zu samples dropped by the sender, %zu bytes sent\n",
+	    pl.dropped, pl.outbytes);
+
+	return pl.failed ? -1 : 0;
+}
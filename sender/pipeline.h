@@ -0,0 +1,43 @@
+
+#ifndef ANDROID_ARM_PROJECT_PIPELINE_H
+#define ANDROID_ARM_PROJECT_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sample_buffer.h"
+
+/*
+ * The pipelined sender runs three threads:
+ *
+ *   device  -- reads struct buffers from the device
+ *   encoder -- resolves process info and encodes packets into chunks
+ *   network -- writes finished chunks out with network_packet()
+ *
+ * Stages are connected by bounded SPSC queues.  Device buffers and
+ * outgoing chunks come from pools allocated up front and are handed back
+ * to their producer once consumed, so nothing is allocated while
+ * sampling.  When the encoder falls behind and the buffer pool runs dry,
+ * the device stage keeps draining the device into a scratch buffer and
+ * reports those samples as missed rather than letting the kernel stall.
+ */
+struct pipeline_config {
+	size_t buffers;		/* Device buffers in the pool */
+	size_t chunks;		/* Outgoing chunks in the pool */
+	size_t chunk_size;	/* Bytes per outgoing chunk */
+	size_t kbytes;		/* Stop after sending this much (0 = never) */
+
+	/* Called by the encoder for every buffer; may be NULL. */
+	void (*inspect)(struct buffer &b);
+};
+
+void pipeline_default_config(struct pipeline_config *config);
+
+/*
+ * Run until the device reports end of file, the kbytes limit is hit or
+ * a send fails.  Returns 0 on a clean finish, -1 on a send error.
+ * Per-stage statistics are printed to stderr on the way out.
+ */
+int pipeline_run(FILE *device, const struct pipeline_config *config);
+
+#endif
@@ -1,26 +1,47 @@
 
+#include "flat_table.h"
+#include "packet.h"
 #include "process_info.h"
+#include "resolver.h"
 #include "sample_buffer.h"
+#include "stats.h"
 
 #include <string.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include <deque>
 #include <fstream>
 #include <streambuf>
-#include <unordered_map>
 
 #define PROCESS_INFO_FLAG_CHECKS (10)
 
+/* Processes remembered at once; the least recently sampled go first */
+#define PROCESS_TABLE_LIMIT (16384)
+
+/*
+ * Batches an exited process is kept after its last sample.  Buffers
+ * still queued in the kernel or the pipeline may hold more of them.
+ */
+#define PROCESS_EXIT_GRACE (512)
+
 using namespace std;
 
-static unordered_map<unsigned long, ProcessInfo> procMap;
+struct exit_note {
+	uint32_t pid;
+	uint64_t batch;		/* When we last looked at it */
+};
+
+static flat_table<ProcessInfo> procMap(PROCESS_TABLE_LIMIT);
+static string_arena strings;		/* cmdline and executable of procMap */
+static deque<struct exit_note> exits;	/* Oldest first */
+static uint64_t batch = 0;
 static unsigned long earliest_zygote = 0;
 
-int read_cmdline(unsigned long pid, string& into);
-int read_executable(unsigned long pid, string& into);
 int load_process_info(struct ProcessInfo& pi);
+static ProcessInfo& lookup_async(unsigned long pid, int check_flags);
 
 ProcessInfo::ProcessInfo()
 {
@@ -31,25 +52,61 @@ ProcessInfo::ProcessInfo()
 
 	pid = 0;
 	mode = Unknown;
+	cmdline = "";
+	executable = "";
+	generation = 0;
+	wire.id = 0;
+	wire.generation = 0;
+	pending = 0;
+	exited = 0;
+}
+
+/* Point pi at copies of these, as a new generation if they changed. */
+static void set_strings(ProcessInfo& pi, const char *cmdline, const char *executable)
+{
+	if (!strcmp(pi.cmdline, cmdline) && !strcmp(pi.executable, executable))
+		return;
+	strings.release(pi.cmdline);
+	strings.release(pi.executable);
+	pi.cmdline = strings.store(cmdline);
+	pi.executable = strings.store(executable);
+	++pi.generation;
+}
+
+static void forget(uint32_t pid, ProcessInfo& pi)
+{
+	(void)(pid);
+	packet_retire(pi);
+	strings.release(pi.cmdline);
+	strings.release(pi.executable);
+}
+
+/* A load finally worked:  stop retrying it and see if we're a zygote. */
+static void loaded(ProcessInfo& pi)
+{
+	pi.flags.cmdexe.checks = 0;
+	pi.flags.zygote.flag = !strcmp(pi.cmdline, "zygote");
+	if (pi.flags.zygote.flag)
+		earliest_zygote = earliest_zygote ? min((unsigned long)(pi.pid), earliest_zygote) : pi.pid;
+	else
+		pi.flags.zygote.checks = 0;
 }
 
 
 ProcessInfo& getProcessInfo(unsigned long pid, int check_flags)
 {
+	if (resolver_running())
+		return lookup_async(pid, check_flags);
+
 	ProcessInfo& pi = procMap[pid];
 
 	/* After this the mode is set, so we only ever do this once. */
 	if (pi.mode == ProcessInfo::Unknown) {
+		stats_add(STAT_PROC_NEW, 1);
 		pi.pid = pid;
 		pi.flags.cmdexe.flag = load_process_info(pi);
-		if (!pi.flags.cmdexe.flag) {
-			pi.flags.cmdexe.checks = 0;
-			pi.flags.zygote.flag = !strcmp(pi.cmdline.c_str(), "zygote");
-			if (pi.flags.zygote.flag)
-				earliest_zygote = earliest_zygote ? min(pid, earliest_zygote) : pid;
-			else
-				pi.flags.zygote.checks = 0;
-		}
+		if (!pi.flags.cmdexe.flag)
+			loaded(pi);
 		return pi;
 	}
 
@@ -61,14 +118,8 @@ ProcessInfo& getProcessInfo(unsigned long pid, int check_flags)
 	if (check_flags && pi.flags.cmdexe.flag && pi.flags.cmdexe.checks) {
 		--pi.flags.cmdexe.checks;
 		pi.flags.cmdexe.flag = load_process_info(pi);
-		if (!pi.flags.cmdexe.flag) {
-			pi.flags.cmdexe.checks = 0;
-			pi.flags.zygote.flag = !strcmp(pi.cmdline.c_str(), "zygote");
-			if (pi.flags.zygote.flag)
-				earliest_zygote = earliest_zygote ? min(pid, earliest_zygote) : pid;
-			else
-				pi.flags.zygote.checks = 0;
-		}
+		if (!pi.flags.cmdexe.flag)
+			loaded(pi);
 		return pi;
 	}
 
@@ -85,7 +136,7 @@ ProcessInfo& getProcessInfo(unsigned long pid, int check_flags)
 		if (load_process_info(pi)) {
 			pi.flags.zygote.checks = 0;
 		} else {
-			pi.flags.zygote.flag = !strcmp(pi.cmdline.c_str(), "zygote");
+			pi.flags.zygote.flag = !strcmp(pi.cmdline, "zygote");
 			if (!pi.flags.zygote.flag)
 				pi.flags.zygote.checks = 0;
 		}
@@ -95,16 +146,141 @@ ProcessInfo& getProcessInfo(unsigned long pid, int check_flags)
 	return pi;
 }
 
+/* Same checks as above, but the reads happen on the resolver thread. */
+static ProcessInfo& lookup_async(unsigned long pid, int check_flags)
+{
+	ProcessInfo& pi = procMap[pid];
+
+	if (pi.pending)
+		return pi;
+
+	if (pi.mode == ProcessInfo::Unknown) {
+		stats_add(STAT_PROC_NEW, 1);
+		pi.pid = pid;
+		pi.flags.cmdexe.flag = 1;
+		pi.pending = !resolver_request(pid);
+		return pi;
+	}
+
+	if (check_flags && pi.flags.cmdexe.flag && pi.flags.cmdexe.checks) {
+		--pi.flags.cmdexe.checks;
+		pi.pending = !resolver_request(pid);
+		return pi;
+	}
+
+	if (check_flags && pi.flags.zygote.flag && (pid > earliest_zygote || pi.flags.zygote.checks)) {
+		if (pi.flags.zygote.checks)
+			--pi.flags.zygote.checks;
+		pi.pending = !resolver_request(pid);
+		return pi;
+	}
+
+	return pi;
+}
+
+static void merge_resolved()
+{
+	struct resolved_process *r = NULL;
+
+	while ((r = resolver_poll())) {
+		if (r->exited) {
+			ProcessInfo *gone = procMap.peek(r->pid);
+			if (gone) {
+				struct exit_note note = { r->pid, batch };
+				gone->exited = 1;
+				exits.push_back(note);
+			}
+			delete r;
+			continue;
+		}
+
+		ProcessInfo& pi = procMap[r->pid];
+		int first = (pi.mode == ProcessInfo::Unknown);
+
+		pi.pid = r->pid;
+		pi.pending = 0;
+		pi.exited = 0;
+		set_strings(pi, r->cmdline.c_str(), r->executable.c_str());
+		pi.mode = (!*pi.cmdline && !*pi.executable) ? ProcessInfo::Kernel : ProcessInfo::User;
+
+		if (first || pi.flags.cmdexe.flag) {
+			pi.flags.cmdexe.flag = r->failed;
+			if (!r->failed)
+				loaded(pi);
+		} else if (pi.flags.zygote.flag) {
+			/* If things go bad, just let them be bad... */
+			if (r->failed) {
+				pi.flags.zygote.checks = 0;
+			} else {
+				pi.flags.zygote.flag = !strcmp(pi.cmdline, "zygote");
+				if (!pi.flags.zygote.flag)
+					pi.flags.zygote.checks = 0;
+			}
+		}
+		delete r;
+	}
+}
+
+/* Drop exited processes once they've gone a while without samples. */
+static void retire_exited()
+{
+	while (!exits.empty() && batch - exits.front().batch >= PROCESS_EXIT_GRACE) {
+		struct exit_note note = exits.front();
+		ProcessInfo *pi = procMap.peek(note.pid);
+
+		exits.pop_front();
+		/* Gone already, or the pid came back as someone else */
+		if (!pi || !pi->exited)
+			continue;
+		if (procMap.age(note.pid)) {
+			note.batch = batch;
+			exits.push_back(note);
+			continue;
+		}
+		forget(note.pid, *pi);
+		procMap.erase(note.pid);
+	}
+}
+
+static void compact_strings()
+{
+	string_arena fresh;
+
+	procMap.for_each([&fresh](uint32_t, ProcessInfo& pi) {
+		pi.cmdline = fresh.store(pi.cmdline);
+		pi.executable = fresh.store(pi.executable);
+	});
+	strings.swap(fresh);
+}
+
+void process_info_update()
+{
+	++batch;
+	if (resolver_running())
+		merge_resolved();
+	retire_exited();
+	procMap.trim(forget);
+	if (strings.fragmented())
+		compact_strings();
+	stats_set(STAT_PROCESSES, procMap.size());
+}
+
 int load_process_info(struct ProcessInfo& pi)
 {
 	int rval = 0;
+	string cmdline;
+	string executable;
+	uint64_t started = stats_now();
 
-	if (read_cmdline(pi.pid, pi.cmdline))
+	if (read_cmdline(pi.pid, cmdline))
 		rval = 1;
-	if (read_executable(pi.pid, pi.executable))
+	if (read_executable(pi.pid, executable))
 		rval = 1;
-	pi.mode = (!*pi.cmdline.c_str() && !*pi.executable.c_str()) ? ProcessInfo::Kernel : ProcessInfo::User;
+	set_strings(pi, cmdline.c_str(), executable.c_str());
+	pi.mode = (!*pi.cmdline && !*pi.executable) ? ProcessInfo::Kernel : ProcessInfo::User;
 
+	stats_time(STAT_PROC_NS, stats_now() - started);
+	stats_add(STAT_PROC_READS, 1);
 	return rval;
 }
 
@@ -19,12 +19,41 @@ struct ProcessInfo {
 		Kernel,
 		User
 	} mode;
-	std::string cmdline;
-	std::string executable;
+	/* First argument only; owned by the process table */
+	const char *cmdline;
+	const char *executable;
+
+	/* Bumped whenever cmdline or executable change */
+	uint32_t generation;
+
+	/* Process-table id the reader knows this generation by (0 = none) */
+	struct {
+		uint32_t id;
+		uint32_t generation;
+	} wire;
+
+	int pending;	/* Waiting on the resolver */
+	int exited;	/* The proc connector saw it exit */
 
 	ProcessInfo();
 };
 
+/*
+ * With the resolver running this never touches /proc:  an unknown pid
+ * gets an empty entry (mode Unknown) until its strings come back, and
+ * re-checks are queued instead of read in place.
+ */
 ProcessInfo& getProcessInfo(unsigned long pid, int check_flags);
 
+/*
+ * Fold in whatever the resolver has found, drop long-exited processes,
+ * evict down to the table's limit and compact its strings.  Entries
+ * may vanish and their strings move, so only call this between
+ * packets.
+ */
+void process_info_update();
+
+int read_cmdline(unsigned long pid, std::string& into);
+int read_executable(unsigned long pid, std::string& into);
+
 #endif
@@ -0,0 +1,349 @@
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <linux/cn_proc.h>
+
+#include <atomic>
+#include <new>
+#include <thread>
+
+#include "process_info.h"
+#include "resolver.h"
+#include "spsc_queue.h"
+#include "stats.h"
+
+#define REQUEST_QUEUE (1024)
+#define RESULT_QUEUE (4096)
+
+static struct {
+	std::thread *thread;
+	std::atomic<int> stop;
+
+	spsc_queue<uint32_t> *requests;			/* encoder -> resolver */
+	spsc_queue<struct resolved_process *> *results;	/* resolver -> encoder */
+
+	int wake;		/* eventfd the encoder pokes after a request */
+	int events;		/* Proc connector socket, -1 without one */
+
+	size_t scanned, forks, execs, exits, requested, lost;
+} rs;
+
+static int connector_open();
+static void connector_read();
+static void scan_proc();
+
+/*
+ * The queues keep their ends on separate cache lines, an alignment plain
+ * new only honours from C++17 on, so they get memory of their own.
+ */
+template <typename Q>
+static Q *new_queue(size_t capacity)
+{
+	void *mem = NULL;
+
+	if (posix_memalign(&mem, alignof(Q), sizeof(Q)))
+		return NULL;
+	return new (mem) Q(capacity);
+}
+
+template <typename Q>
+static void delete_queue(Q *q)
+{
+	if (!q)
+		return;
+	q->~Q();
+	free(q);
+}
+
+static void push_result(struct resolved_process *r)
+{
+	struct timespec ts = {0, 1000000};
+
+	while (!rs.results->push(r)) {
+		/* The encoder drains once per buffer; wait for it. */
+		if (rs.stop.load(std::memory_order_relaxed)) {
+			delete r;
+			return;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void resolve(uint32_t pid)
+{
+	struct resolved_process *r = new resolved_process;
+
+	r->pid = pid;
+	r->exited = 0;
+	r->failed = read_cmdline(pid, r->cmdline) | read_executable(pid, r->executable);
+	push_result(r);
+}
+
+static void resolve_exit(uint32_t pid)
+{
+	struct resolved_process *r = new resolved_process;
+
+	r->pid = pid;
+	r->exited = 1;
+	r->failed = 0;
+	push_result(r);
+}
+
+/* What the encoder is waiting on goes first */
+static void serve_requests()
+{
+	uint32_t pid = 0;
+
+	while (rs.requests->pop(pid)) {
+		++rs.requested;
+		resolve(pid);
+	}
+}
+
+static void resolver_main()
+{
+	struct pollfd fds[2];
+	uint64_t count = 0;
+
+	scan_proc();
+
+	while (!rs.stop.load(std::memory_order_relaxed)) {
+		fds[0].fd = rs.wake;
+		fds[0].events = POLLIN;
+		fds[1].fd = rs.events;
+		fds[1].events = POLLIN;
+		if (poll(&fds[0], rs.events < 0 ? 1 : 2, 100) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			ssize_t ignore = read(rs.wake, &count, sizeof(count));
+			(void)(ignore);
+		}
+		serve_requests();
+		if (rs.events >= 0 && (fds[1].revents & POLLIN))
+			connector_read();
+	}
+}
+
+int resolver_start()
+{
+	if (rs.thread)
+		return 0;
+
+	rs.requests = new_queue<spsc_queue<uint32_t> >(REQUEST_QUEUE);
+	rs.results = new_queue<spsc_queue<struct resolved_process *> >(RESULT_QUEUE);
+	if (!rs.requests || !rs.results) {
+		fprintf(stderr, "resolver:  out of memory for queues\n");
+		delete_queue(rs.requests);
+		delete_queue(rs.results);
+		rs.requests = NULL;
+		rs.results = NULL;
+		return -1;
+	}
+
+	rs.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rs.wake < 0) {
+		fprintf(stderr, "resolver:  eventfd failed:  %s\n", strerror(errno));
+		delete_queue(rs.requests);
+		delete_queue(rs.results);
+		rs.requests = NULL;
+		rs.results = NULL;
+		return -1;
+	}
+	rs.events = connector_open();
+	rs.scanned = rs.forks = rs.execs = rs.exits = rs.requested = rs.lost = 0;
+	rs.stop = 0;
+	rs.thread = new std::thread(resolver_main);
+	return 0;
+}
+
+void resolver_stop()
+{
+	struct resolved_process *r = NULL;
+	uint64_t one = 1;
+
+	if (!rs.thread)
+		return;
+
+	rs.stop = 1;
+	if (write(rs.wake, &one, sizeof(one)) < 0)
+		fprintf(stderr, "resolver:  wakeup failed:  %s\n", strerror(errno));
+	rs.thread->join();
+	delete rs.thread;
+	rs.thread = NULL;
+
+	while (rs.results->pop(r))
+		delete r;
+	delete_queue(rs.results);
+	delete_queue(rs.requests);
+	rs.results = NULL;
+	rs.requests = NULL;
+	if (rs.events >= 0)
+		close(rs.events);
+	close(rs.wake);
+
+	fprintf(stderr, "Process resolver:  %zu scanned, %zu forks, %zu execs, "
+	    "%zu exits, %zu requests, %zu event overruns\n",
+	    rs.scanned, rs.forks, rs.execs, rs.exits, rs.requested, rs.lost);
+}
+
+int resolver_running()
+{
+	return rs.thread != NULL;
+}
+
+int resolver_request(uint32_t pid)
+{
+	uint64_t one = 1;
+
+	if (!rs.requests->push(pid))
+		return -1;
+	stats_add(STAT_PROC_REQUESTS, 1);
+	stats_set(STAT_RESOLVER_QUEUE, rs.requests->size());
+	/* Only fails if the counter would overflow, and then it's awake anyway */
+	if (write(rs.wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+struct resolved_process *resolver_poll()
+{
+	struct resolved_process *r = NULL;
+
+	if (!rs.results->pop(r))
+		return NULL;
+	return r;
+}
+
+/* Every thread of every process; samples carry thread ids. */
+static void scan_proc()
+{
+	DIR *proc = opendir("/proc");
+	struct dirent *de = NULL;
+
+	if (!proc) {
+		fprintf(stderr, "resolver:  cannot scan /proc:  %s\n", strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(proc)) && !rs.stop.load(std::memory_order_relaxed)) {
+		char path[sizeof("/proc//task") + sizeof(de->d_name)] = {0};
+		struct dirent *te = NULL;
+		DIR *tasks = NULL;
+
+		if (!isdigit(de->d_name[0]))
+			continue;
+		serve_requests();
+		snprintf(&path[0], sizeof(path), "/proc/%s/task", de->d_name);
+		tasks = opendir(&path[0]);
+		if (!tasks) {
+			/* Gone already, or an old kernel without task/ */
+			resolve(atoi(de->d_name));
+			++rs.scanned;
+			continue;
+		}
+		while ((te = readdir(tasks))) {
+			if (!isdigit(te->d_name[0]))
+				continue;
+			resolve(atoi(te->d_name));
+			++rs.scanned;
+		}
+		closedir(tasks);
+	}
+	closedir(proc);
+}
+
+/*
+ * Proc connector.  Listening needs CAP_NET_ADMIN; without it the scan
+ * and encoder requests still cover everything, just later.
+ */
+static int connector_open()
+{
+	struct sockaddr_nl addr;
+	char msg[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+	struct nlmsghdr *nl = (struct nlmsghdr *)(&msg[0]);
+	struct cn_msg *cn = (struct cn_msg *)(NLMSG_DATA(nl));
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+
+	if (fd < 0) {
+		fprintf(stderr, "resolver:  no proc connector:  %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	if (bind(fd, (struct sockaddr *)(&addr), sizeof(addr))) {
+		fprintf(stderr, "resolver:  proc connector bind:  %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&msg[0], 0, sizeof(msg));
+	nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+	nl->nlmsg_type = NLMSG_DONE;
+	nl->nlmsg_pid = getpid();
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof(op);
+	memcpy(cn->data, &op, sizeof(op));
+	if (send(fd, &msg[0], nl->nlmsg_len, 0) < 0) {
+		fprintf(stderr, "resolver:  proc connector listen:  %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void connector_read()
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nl = NULL;
+	ssize_t len = recv(rs.events, &buf[0], sizeof(buf), MSG_DONTWAIT);
+
+	if (len < 0) {
+		/* Fork storm outran us; requests will fill the gaps */
+		if (errno == ENOBUFS)
+			++rs.lost;
+		return;
+	}
+
+	for (nl = (struct nlmsghdr *)(&buf[0]); NLMSG_OK(nl, (size_t)(len));
+	     nl = NLMSG_NEXT(nl, len)) {
+		struct cn_msg *cn = (struct cn_msg *)(NLMSG_DATA(nl));
+		struct proc_event *ev = (struct proc_event *)(cn->data);
+
+		if (nl->nlmsg_type != NLMSG_DONE || cn->id.idx != CN_IDX_PROC)
+			continue;
+
+		switch (ev->what) {
+			case proc_event::PROC_EVENT_FORK:
+				++rs.forks;
+				resolve(ev->event_data.fork.child_pid);
+				break;
+			case proc_event::PROC_EVENT_EXEC:
+				++rs.execs;
+				resolve(ev->event_data.exec.process_pid);
+				break;
+			case proc_event::PROC_EVENT_EXIT:
+				++rs.exits;
+				resolve_exit(ev->event_data.exit.process_pid);
+				break;
+			default:
+				break;
+		}
+	}
+}
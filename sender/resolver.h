@@ -0,0 +1,39 @@
+
+#ifndef ANDROID_ARM_PROJECT_RESOLVER_H
+#define ANDROID_ARM_PROJECT_RESOLVER_H
+
+#include <stdint.h>
+
+#include <string>
+
+/*
+ * Background process resolver.  A thread of its own reads cmdline and
+ * exe out of /proc so the encoder never waits on the filesystem.  It
+ * starts with a scan of every task in /proc, then follows fork, exec and
+ * exit events from the netlink proc connector (when we are allowed to
+ * listen), and also resolves any pid the encoder asks about.
+ *
+ * Requests go in and results come out through SPSC queues, so only one
+ * thread (whichever encodes) may call resolver_request() and
+ * resolver_poll().
+ */
+struct resolved_process {
+	uint32_t pid;
+	int failed;		/* Either string could not be read */
+	int exited;		/* Exit event; the strings are empty */
+	std::string cmdline;
+	std::string executable;
+};
+
+/* Returns 0 once the thread is running, -1 if it could not be started. */
+int resolver_start();
+void resolver_stop();
+int resolver_running();
+
+/* Ask for pid to be (re)read.  Returns -1 if the queue is full. */
+int resolver_request(uint32_t pid);
+
+/* Next result, or NULL if there is none.  The caller deletes it. */
+struct resolved_process *resolver_poll();
+
+#endif
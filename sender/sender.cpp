@@ -6,14 +6,20 @@
 
 #include "network.h"
 #include "packet.h"
+#include "pipeline.h"
 #include "sample_buffer.h"
 #include "process_info.h"
+#include "resolver.h"
+#include "stats.h"
+#include "throttle.h"
+#include "aggregate.h"
+#include "uring.h"
 
 static FILE *grab_device();
-static FILE *missed_buffer();
 
 static int make_connection(const char *domain, const char *service);
-static void sample_device(FILE *device, FILE *missed, int test);
+static int open_output(const char *path, int direct);
+static void sample_device(FILE *device, int test);
 static int send_header();
 static void close_connection();
 static void debug_out(struct buffer &b);
@@ -21,8 +27,17 @@ static void debug_out(struct buffer &b);
 static int grab_value(char *buffer, size_t n, const char *pmu_prop);
 
 static int debug;
-static int initial_missed;
-static int missed_count;
+static int serial;
+static int use_uring;
+static const char *output_path;
+static int output_direct;
+static const char *spool_path;
+static size_t spool_mbytes;
+static const char *stats_path;
+static int stats_interval;
+static size_t rate_kbytes;
+static enum throttle_policy degrade;
+static unsigned aggregate_ms;
 
 static size_t kbytes;
 static size_t outbytes;
@@ -30,7 +45,6 @@ static size_t outbytes;
 int main(int argc, const char** argv) {
 	const char *arg = NULL;
 	FILE *src = grab_device();
-	FILE *miss = missed_buffer();
 	int i = 0;
 
 	const char *program = *argv;
@@ -38,6 +52,17 @@ int main(int argc, const char** argv) {
 
 	kbytes = 0;
 	debug = 0;
+	serial = 0;
+	use_uring = 0;
+	output_path = NULL;
+	output_direct = 0;
+	spool_path = NULL;
+	spool_mbytes = 64;
+	stats_path = NULL;
+	stats_interval = -1;
+	rate_kbytes = 0;
+	degrade = THROTTLE_NTH;
+	aggregate_ms = 0;
 	while (argc) {
 		if (!strcmp("-d", *argv)) {
 			debug = 1;
@@ -47,6 +72,133 @@ int main(int argc, const char** argv) {
 			continue;
 		}
 
+		if (!strcmp("-s", *argv)) {
+			/* Read, encode, send and read /proc on one thread, as we used to */
+			serial = 1;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("-u", *argv)) {
+			/* Single-threaded io_uring engine, if the kernel lets us */
+			use_uring = 1;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("-o", *argv)) {
+			/* Write the stream to a file ("-" for stdout) instead */
+			--argc; ++argv;
+			if (!argc || !**argv) {
+				fprintf(stderr, "-o requires a path or -.\n");
+				return -1;
+			}
+			output_path = *argv;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--direct", *argv)) {
+			/* O_DIRECT for -o, bypassing the page cache */
+			output_direct = 1;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--spool", *argv)) {
+			/* Queue through a ring file; ride out collector outages */
+			--argc; ++argv;
+			if (!argc || !**argv) {
+				fprintf(stderr, "--spool requires a path.\n");
+				return -1;
+			}
+			spool_path = *argv;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--spool-size", *argv)) {
+			/* Megabytes of spool ring */
+			--argc; ++argv;
+			if (!argc || !isdigit(**argv) || !(spool_mbytes = atoi(*argv))) {
+				fprintf(stderr, "--spool-size requires a number of megabytes.\n");
+				return -1;
+			}
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--stats", *argv)) {
+			/* Append JSON statistics lines here (every 10s by default) */
+			--argc; ++argv;
+			if (!argc || !**argv) {
+				fprintf(stderr, "--stats requires a path.\n");
+				return -1;
+			}
+			stats_path = *argv;
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--stats-interval", *argv)) {
+			/* Seconds between dumps; 0 dumps only on SIGUSR1 */
+			--argc; ++argv;
+			if (!argc || !isdigit(**argv)) {
+				fprintf(stderr, "--stats-interval requires a number of seconds.\n");
+				return -1;
+			}
+			stats_interval = atoi(*argv);
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--rate", *argv)) {
+			/* Cap the stream at this many kilobytes a second */
+			--argc; ++argv;
+			if (!argc || !isdigit(**argv) || !(rate_kbytes = atoi(*argv))) {
+				fprintf(stderr, "--rate requires a number of kilobytes per second.\n");
+				return -1;
+			}
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--degrade", *argv)) {
+			/* What --rate gives up first:  nth, aggregate or kernel */
+			--argc; ++argv;
+			if (!argc || throttle_policy_by_name(*argv, &degrade)) {
+				fprintf(stderr, "--degrade requires a policy (nth, aggregate, kernel).\n");
+				return -1;
+			}
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("--aggregate", *argv)) {
+			/* Send per pid and core sums every this many ms instead of samples */
+			--argc; ++argv;
+			if (!argc || !isdigit(**argv) || !(aggregate_ms = atoi(*argv))) {
+				fprintf(stderr, "--aggregate requires an interval in milliseconds.\n");
+				return -1;
+			}
+			--argc; ++argv;
+			continue;
+		}
+
+		if (!strcmp("-f", *argv)) {
+			/* Wire format features, e.g. -f columnar */
+			uint32_t format = 0;
+			--argc; ++argv;
+			if (!argc || packet_format_by_name(*argv, &format)) {
+				fprintf(stderr, "-f requires a comma separated list of formats "
+				    "(columnar, proctable, multipid, wide, weighted, aggregate).\n");
+				return -1;
+			}
+			packet_set_format(format);
+			--argc; ++argv;
+			continue;
+		}
+
 		if (!strcmp("-k", *argv)) {
 			--argc; ++argv;
 			if (!argc) {
@@ -75,16 +227,57 @@ int main(int argc, const char** argv) {
 		break;
 	}
 
-	if (argc < 2) {
-		fprintf(stderr, "Not enough arguments.  %s host port", program);
-		return -1;
+	/* Aggregate records name processes by process-table id */
+	if (aggregate_ms) {
+		aggregate_set(aggregate_ms);
+		packet_set_format(packet_get_format() |
+		    PACKET_FORMAT_AGGREGATE | PACKET_FORMAT_PROCTABLE);
+		if (rate_kbytes)
+			fprintf(stderr, "--aggregate sends no samples for --rate to thin; ignoring it.\n");
+		rate_kbytes = 0;
+	}
+
+	/* Thinned samples are only meaningful with their weights */
+	if (rate_kbytes) {
+		throttle_set(rate_kbytes * 1000, degrade);
+		packet_set_format(packet_get_format() | PACKET_FORMAT_WEIGHTED);
+		if (degrade == THROTTLE_AGGREGATE)
+			packet_set_format(packet_get_format() |
+			    PACKET_FORMAT_AGGREGATE | PACKET_FORMAT_PROCTABLE);
 	}
 
-	if (make_connection(argv[0], argv[1]))
+	/* Before anything starts a thread:  they must all inherit the signal mask */
+	if (stats_interval < 0)
+		stats_interval = stats_path ? 10 : 0;
+	if (stats_start(stats_path, stats_interval))
 		return -1;
-	fprintf(stderr, "Network Connected.\n");
-	argc -= 2;
-	argv += 2;
+
+	if (output_path) {
+		if (open_output(output_path, output_direct))
+			return -1;
+	} else if (spool_path) {
+		if (argc < 2) {
+			fprintf(stderr, "Not enough arguments.  %s --spool <path> host port\n", program);
+			return -1;
+		}
+
+		/* Connects in the background, so a missing collector is fine */
+		if (network_spool(spool_path, spool_mbytes << 20, argv[0], argv[1]))
+			return -1;
+		argc -= 2;
+		argv += 2;
+	} else {
+		if (argc < 2) {
+			fprintf(stderr, "Not enough arguments.  %s host port | -o <path|->\n", program);
+			return -1;
+		}
+
+		if (make_connection(argv[0], argv[1]))
+			return -1;
+		fprintf(stderr, "Network Connected.\n");
+		argc -= 2;
+		argv += 2;
+	}
 
 	if (send_header()) {
 		fprintf(stderr, "Error sending header.\n");
@@ -92,24 +285,46 @@ int main(int argc, const char** argv) {
 		return -1;
 	}
 
+	if (use_uring && spool_path) {
+		fprintf(stderr, "io_uring can't write through the spool, using the threaded pipeline.\n");
+		use_uring = 0;
+	}
+
+	if (use_uring && !serial && !uring_supported()) {
+		fprintf(stderr, "io_uring unavailable, using the threaded pipeline.\n");
+		use_uring = 0;
+	}
+
+	/* Keep /proc off the encoding path; synchronous lookups still work without it */
+	if (!serial && resolver_start())
+		fprintf(stderr, "Process resolver unavailable, reading /proc inline.\n");
+
 	fprintf(stderr, "Starting sampling...\n");
-	if (src && miss) {
-		/* Clear things out so we can get a clear missed count */
-		initial_missed = 0;
+	if (src) {
+		/* Clear out what piled up before we were reading */
 		for (i = 0; i < 2; ++i)
-			sample_device(src, miss, 1);
-		initial_missed = missed_count;
+			sample_device(src, 1);
 		outbytes = 0;
-		sample_device(src, miss, 0);
-
+		if (serial) {
+			sample_device(src, 0);
+		} else {
+			struct pipeline_config config;
+			pipeline_default_config(&config);
+			config.kbytes = kbytes;
+			config.inspect = debug ? debug_out : NULL;
+			if (use_uring)
+				uring_run(src, &config);
+			else
+				pipeline_run(src, &config);
+		}
 	}
 	fprintf(stderr, "Sampling finished!\n");
+	resolver_stop();
 	close_connection();
+	stats_stop();
 
 	if (src)
 		fclose(src);
-	if (miss)
-		fclose(miss);
 
 	return 0;
 }
@@ -122,14 +337,6 @@ FILE *grab_device()
 	return f;
 }
 
-FILE *missed_buffer()
-{
-	FILE *f = fopen("/sys/sync_pmu/missed", "r");
-	if (!f)
-		fprintf(stderr, "Error opening missed buffers file:  %s\n", strerror(errno));
-	return f;
-}
-
 int send_header()
 {
 	char period[64] = {0};
@@ -139,8 +346,10 @@ int send_header()
 	char counter4[64] = {0};
 	char counter5[64] = {0};
 	char counter6[64] = {0};
+	char counters[64] = {0};
 
 	char header[1024] = {0};
+	char format[32] = {0};
 
 	if (debug) {
 		fprintf(stderr, "Getting values for header.\n");
@@ -154,11 +363,19 @@ int send_header()
 	    grab_value(&counter4[0], 64, "3"))
 		return -1;
 
+	/* Older modules don't say, and always fill in all six */
+	if (!grab_value(&counters[0], 64, "counters"))
+		packet_set_counters((uint8_t)(atoi(&counters[0])));
+
 	if (debug) {
 		fprintf(stderr, "Values retrieved.\n");
 		fflush(stderr);
 	}
 
+	/* Plain streams stay byte for byte what they always were */
+	if (packet_get_format())
+		sprintf(&format[0], "format:  0x%x\n", packet_get_format());
+
 	sprintf(&header[0],
 	  "period:  %s"
 	  "event1:  %s"
@@ -167,13 +384,14 @@ int send_header()
 	  "event4:  %s"
 	  "event5:  %s"
 	  "event6:  %s"
+	  "%s"
 	  "%c",
 	  &period[0], &counter1[0], &counter2[0], &counter3[0],
-	  &counter4[0], &counter5[0], &counter6[0], '\0');
+	  &counter4[0], &counter5[0], &counter6[0], &format[0], '\0');
 
 	if (debug)
 		fprintf(stderr, "HEADER:\n%s\n", &header[0]);
-	return network_packet(&header[0], strlen(&header[0]) + 1, NULL);
+	return network_header(&header[0], strlen(&header[0]) + 1, NULL);
 }
 
 int grab_value(char *buffer, size_t n, const char *pmu_prop)
@@ -191,6 +409,11 @@ int grab_value(char *buffer, size_t n, const char *pmu_prop)
 		fflush(stderr);
 	}
 	f = fopen(&path[0], "r");
+	if (!f) {
+		if (debug)
+			fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
 	char* ignore = fgets(buffer, n-1, f);
 	buffer[n-1] = '\0';
 	if (debug) {
@@ -210,20 +433,32 @@ int make_connection(const char *domain, const char *service)
 	return network_status;
 }
 
-void sample_device(FILE *f, FILE *m, int test)
+int open_output(const char *path, int direct)
+{
+	if (network_open_file(path, direct))
+		return -1;
+	fprintf(stderr, "Writing to %s.\n", strcmp(path, "-") ? path : "stdout");
+	return 0;
+}
+
+void sample_device(FILE *f, int test)
 {
 	struct buffer b;
 	size_t read = 0;
 	char *packet = NULL;
-	char count[24] = {0}; // Never gonna fill up
 	int i = 0;
 	size_t sent = 0;
 
 	while (!feof(f)) {
-		size_t rc = fread(&b, sizeof(struct buffer), 1, f);
-		char* rcc = fgets(&count[0], 23, m);
-		missed_count = atoi(&count[0]) - initial_missed;
-		if (!test && network_send(b, missed_count, &sent)) {
+		uint64_t started = stats_now();
+		/* A short read is the end; don't send the last buffer twice */
+		if (fread(&b, sizeof(struct buffer), 1, f) != 1)
+			break;
+		stats_time(STAT_READ_NS, stats_now() - started);
+		stats_add(STAT_DEVICE_READS, 1);
+		stats_add(STAT_DEVICE_BYTES, sizeof(struct buffer));
+		stats_add(STAT_KERNEL_MISSED, b.missed);
+		if (!test && network_send(b, 0, &sent)) {
 			fprintf(stderr, "error:  Could not send batch from buffer:  %s\n", strerror(errno));
 			break;
 		}
@@ -233,7 +468,7 @@ void sample_device(FILE *f, FILE *m, int test)
 			break;
 		outbytes += sent;
 		if (kbytes > 0 && outbytes / 1000 > kbytes) {
-			fprintf(stdout, "%zu kb requested, %zu bytes sent.\n", kbytes, outbytes);
+			fprintf(stderr, "%zu kb requested, %zu bytes sent.\n", kbytes, outbytes);
 			break;
 		}
 	}
@@ -254,6 +489,6 @@ void debug_out(struct buffer& b) {
 			c.pid, b.core, c.cycles,
 			c.counters[0], c.counters[1], c.counters[2],
 			c.counters[3], c.counters[4], c.counters[5],
-			pi.cmdline.c_str(), pi.executable.c_str());
+			pi.cmdline, pi.executable);
 	}
 }
@@ -0,0 +1,426 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "spool.h"
+#include "stats.h"
+
+/* Every entry in the ring starts on an 8 byte boundary with this */
+struct entry_head {
+	uint32_t bytes;
+	uint32_t kind;
+	uint64_t at;		/* Stream bytes written before this entry */
+};
+
+#define ENTRY_DATA (0)
+#define ENTRY_WRAP (1)		/* Rest of the ring is unused; go to 0 */
+#define ENTRY_GAP (2)		/* Writes were dropped before this point */
+
+#define MIN_BACKOFF_MS (100)
+#define MAX_BACKOFF_MS (30000)
+
+static struct {
+	char *ring;
+	size_t size;
+	int fd;
+
+	/* Positions only ever grow; the offset is position % size */
+	std::atomic<size_t> head;	/* Next byte to send, owned by the thread */
+	std::atomic<size_t> tail;	/* Next byte to fill, owned by writers */
+	int gap;			/* Writer dropped something (see spool_write) */
+	uint64_t written;		/* Stream bytes given to spool_write, dropped or not */
+	std::atomic<uint64_t> done;	/* Stream bytes the thread is through with */
+
+	struct addrinfo *addr;
+	int sock;
+	size_t partial;			/* Bytes of the head entry already sent */
+
+	std::mutex lock;		/* Guards header, records and retired */
+	std::string header;
+	std::map<uint32_t, std::string> records;	/* By id, for ids in use */
+	/*
+	 * Records of retired ids, with where their retire record ends in
+	 * the stream (oldest first).  Data before that may still use them,
+	 * so they are kept until the thread is past it.
+	 */
+	std::deque<std::pair<uint64_t, std::string> > retired;
+
+	std::thread *thread;
+	std::atomic<int> stop;
+	std::atomic<long> deadline_ms;	/* Give up draining after this */
+
+	/* Statistics */
+	size_t queued, sent, dropped, drops, connects, failures, max_fill;
+} sp;
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static size_t align8(size_t n)
+{
+	return (n + 7) & ~(size_t)(7);
+}
+
+/*
+ * Writer side.  A data entry always leaves room for one more header so
+ * the gap marker that follows a drop can always be written.
+ */
+static int push(const void *data, size_t bytes, uint32_t kind)
+{
+	size_t head = sp.head.load(std::memory_order_acquire);
+	size_t tail = sp.tail.load(std::memory_order_relaxed);
+	size_t need = sizeof(struct entry_head) + align8(bytes);
+	size_t reserve = kind == ENTRY_GAP ? 0 : sizeof(struct entry_head);
+	size_t pos = tail % sp.size;
+	size_t skip = pos + need > sp.size ? sp.size - pos : 0;
+	struct entry_head *eh = NULL;
+
+	if (sp.size - (tail - head) < skip + need + reserve)
+		return -1;
+
+	if (skip) {
+		eh = (struct entry_head *)(sp.ring + pos);
+		eh->bytes = 0;
+		eh->kind = ENTRY_WRAP;
+		tail += skip;
+		pos = 0;
+	}
+	eh = (struct entry_head *)(sp.ring + pos);
+	eh->bytes = bytes;
+	eh->kind = kind;
+	eh->at = sp.written;
+	if (bytes)
+		memcpy(eh + 1, data, bytes);
+	tail += need;
+	sp.tail.store(tail, std::memory_order_release);
+
+	if (tail - head > sp.max_fill)
+		sp.max_fill = tail - head;
+	stats_set(STAT_SPOOL_FILL, tail - head);
+	return 0;
+}
+
+int spool_write(const void *data, size_t bytes)
+{
+	if (!sp.ring)
+		return -1;
+
+	/* 1: the marker for a drop is still to be written, 2: it has been */
+	if (sp.gap == 1 && push(NULL, 0, ENTRY_GAP) == 0)
+		sp.gap = 2;
+	if (sp.gap == 1 || push(data, bytes, ENTRY_DATA)) {
+		if (!sp.gap) {
+			++sp.drops;
+			sp.gap = 1;
+		}
+		sp.dropped += bytes;
+		sp.written += bytes;
+		return 0;
+	}
+	sp.gap = 0;
+	sp.queued += bytes;
+	sp.written += bytes;
+	return 0;
+}
+
+int spool_header(const void *header, size_t bytes)
+{
+	std::lock_guard<std::mutex> hold(sp.lock);
+
+	sp.header.assign((const char *)(header), bytes);
+	return 0;
+}
+
+/* Forget retired records the stream is past; hold sp.lock */
+static void prune_retired()
+{
+	uint64_t done = sp.done.load(std::memory_order_acquire);
+
+	while (!sp.retired.empty() && sp.retired.front().first <= done)
+		sp.retired.pop_front();
+}
+
+void spool_record(uint32_t id, const void *record, size_t bytes)
+{
+	std::lock_guard<std::mutex> hold(sp.lock);
+
+	sp.records[id].assign((const char *)(record), bytes);
+}
+
+void spool_retire(uint32_t id, uint64_t at)
+{
+	std::lock_guard<std::mutex> hold(sp.lock);
+	std::map<uint32_t, std::string>::iterator it = sp.records.find(id);
+
+	prune_retired();
+	if (it == sp.records.end())
+		return;
+	sp.retired.push_back(std::make_pair(at, std::string()));
+	sp.retired.back().second.swap(it->second);
+	sp.records.erase(it);
+}
+
+/* Connection side, all on the spool thread */
+
+static void disconnect()
+{
+	if (sp.sock >= 0)
+		close(sp.sock);
+	sp.sock = -1;
+	sp.partial = 0;
+}
+
+/* Send all of it, waiting as long as it takes or until we are told to stop. */
+static int send_all(const char *data, size_t bytes)
+{
+	while (bytes) {
+		ssize_t rc = send(sp.sock, data, bytes, MSG_NOSIGNAL);
+		struct pollfd pfd = { sp.sock, POLLOUT, 0 };
+
+		if (rc > 0) {
+			data += rc;
+			bytes -= rc;
+			continue;
+		}
+		if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return -1;
+		if (sp.stop.load(std::memory_order_relaxed) &&
+		    now_ms() > sp.deadline_ms.load(std::memory_order_relaxed))
+			return -1;
+		poll(&pfd, 1, 100);
+	}
+	return 0;
+}
+
+static int try_connect()
+{
+	struct addrinfo *a = NULL;
+	std::map<uint32_t, std::string>::const_iterator it;
+	size_t i = 0;
+	std::string preamble;
+
+	for (a = sp.addr; a; a = a->ai_next) {
+		struct pollfd pfd;
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		sp.sock = socket(a->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sp.sock < 0)
+			continue;
+		if (connect(sp.sock, a->ai_addr, a->ai_addrlen) && errno != EINPROGRESS) {
+			disconnect();
+			continue;
+		}
+		pfd.fd = sp.sock;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 1000) == 1 &&
+		    !getsockopt(sp.sock, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+			break;
+		disconnect();
+	}
+	if (sp.sock < 0)
+		return -1;
+
+	/* Everything a reader needs before the first packet we still hold */
+	{
+		std::lock_guard<std::mutex> hold(sp.lock);
+
+		prune_retired();
+		preamble = sp.header;
+		for (it = sp.records.begin(); it != sp.records.end(); ++it)
+			preamble += it->second;
+		for (i = 0; i < sp.retired.size(); ++i)
+			preamble += sp.retired[i].second;
+	}
+	if (send_all(preamble.data(), preamble.size())) {
+		disconnect();
+		return -1;
+	}
+	++sp.connects;
+	return 0;
+}
+
+/* Send (the rest of) the entry at head.  1 if the ring is empty, -1 on error. */
+static int send_entry()
+{
+	size_t head = sp.head.load(std::memory_order_relaxed);
+	size_t tail = sp.tail.load(std::memory_order_acquire);
+	struct entry_head *eh = NULL;
+	size_t pos = head % sp.size;
+
+	if (head == tail)
+		return 1;
+
+	eh = (struct entry_head *)(sp.ring + pos);
+	if (eh->kind == ENTRY_WRAP) {
+		sp.head.store(head + sp.size - pos, std::memory_order_release);
+		return 0;
+	}
+	if (eh->kind == ENTRY_GAP) {
+		/* The stream has a hole; start a fresh one after it */
+		sp.head.store(head + sizeof(*eh), std::memory_order_release);
+		return -1;
+	}
+
+	while (sp.partial < eh->bytes) {
+		ssize_t rc = send(sp.sock, (char *)(eh + 1) + sp.partial,
+		    eh->bytes - sp.partial, MSG_NOSIGNAL | MSG_DONTWAIT);
+		struct pollfd pfd = { sp.sock, POLLOUT, 0 };
+
+		if (rc > 0) {
+			sp.partial += rc;
+			continue;
+		}
+		if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return -1;
+		if (sp.stop.load(std::memory_order_relaxed) &&
+		    now_ms() > sp.deadline_ms.load(std::memory_order_relaxed))
+			return -1;
+		poll(&pfd, 1, 100);
+	}
+
+	sp.sent += eh->bytes;
+	sp.partial = 0;
+	sp.done.store(eh->at + eh->bytes, std::memory_order_release);
+	sp.head.store(head + sizeof(*eh) + align8(eh->bytes), std::memory_order_release);
+	return 0;
+}
+
+static void spool_main()
+{
+	struct timespec idle = {0, 1000000};
+	long backoff = MIN_BACKOFF_MS;
+	long retry_at = 0;
+
+	for (;;) {
+		int stopping = sp.stop.load(std::memory_order_relaxed);
+		int rc = 0;
+
+		if (stopping && (sp.head.load() == sp.tail.load() ||
+		    now_ms() > sp.deadline_ms.load(std::memory_order_relaxed)))
+			break;
+
+		if (sp.sock < 0) {
+			if (now_ms() < retry_at) {
+				nanosleep(&idle, NULL);
+				continue;
+			}
+			if (try_connect()) {
+				++sp.failures;
+				retry_at = now_ms() + backoff;
+				backoff = backoff * 2 > MAX_BACKOFF_MS ? MAX_BACKOFF_MS : backoff * 2;
+				continue;
+			}
+			backoff = MIN_BACKOFF_MS;
+		}
+
+		rc = send_entry();
+		if (rc > 0)
+			nanosleep(&idle, NULL);
+		else if (rc < 0)
+			disconnect();
+	}
+	disconnect();
+}
+
+int spool_open(const char *path, size_t bytes, const char *node, const char *service)
+{
+	struct addrinfo hints;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int status = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	status = getaddrinfo(node, service, &hints, &sp.addr);
+	if (status) {
+		fprintf(stderr, "gaierror:  %s\n", gai_strerror(status));
+		sp.addr = NULL;
+		return -1;
+	}
+
+	sp.size = (bytes + page - 1) / page * page;
+	sp.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (sp.fd < 0 || ftruncate(sp.fd, sp.size)) {
+		fprintf(stderr, "spool error:  %s:  %s\n", path, strerror(errno));
+		goto fail;
+	}
+	sp.ring = (char *)(mmap(NULL, sp.size, PROT_READ | PROT_WRITE, MAP_SHARED, sp.fd, 0));
+	if (sp.ring == MAP_FAILED) {
+		fprintf(stderr, "spool mmap error:  %s\n", strerror(errno));
+		sp.ring = NULL;
+		goto fail;
+	}
+
+	sp.head = 0;
+	sp.tail = 0;
+	sp.gap = 0;
+	sp.written = 0;
+	sp.done = 0;
+	sp.sock = -1;
+	sp.partial = 0;
+	sp.records.clear();
+	sp.retired.clear();
+	sp.queued = sp.sent = sp.dropped = sp.drops = 0;
+	sp.connects = sp.failures = sp.max_fill = 0;
+	sp.stop = 0;
+	sp.thread = new std::thread(spool_main);
+	return 0;
+
+fail:
+	if (sp.fd >= 0)
+		close(sp.fd);
+	sp.fd = -1;
+	freeaddrinfo(sp.addr);
+	sp.addr = NULL;
+	return -1;
+}
+
+void spool_close(int timeout_ms)
+{
+	if (!sp.thread)
+		return;
+
+	sp.deadline_ms = now_ms() + timeout_ms;
+	sp.stop = 1;
+	sp.thread->join();
+	delete sp.thread;
+	sp.thread = NULL;
+
+	fprintf(stderr, "Spool:  %zu bytes queued, %zu sent, %zu left unsent, "
+	    "%zu dropped in %zu gaps, peak fill %zu of %zu, %zu connects, %zu failed attempts\n",
+	    sp.queued, sp.sent, sp.queued - sp.sent,
+	    sp.dropped, sp.drops, sp.max_fill, sp.size, sp.connects, sp.failures);
+
+	munmap(sp.ring, sp.size);
+	sp.ring = NULL;
+	close(sp.fd);
+	sp.fd = -1;
+	sp.records.clear();
+	sp.retired.clear();
+	freeaddrinfo(sp.addr);
+	sp.addr = NULL;
+}
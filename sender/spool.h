@@ -0,0 +1,54 @@
+
+#ifndef ANDROID_ARM_PROJECT_SPOOL_H
+#define ANDROID_ARM_PROJECT_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Spooled sending.  Outgoing data is appended to a ring in a
+ * memory-mapped file and a thread of its own drains the ring into a
+ * non-blocking socket, so writers only ever copy into memory.  When the
+ * collector is slow or gone the ring fills up (the page cache spilling
+ * to disk) instead of the device backing up.
+ *
+ * The connection is (re)made in the background with exponential
+ * backoff.  Every connection starts with the experiment info and the
+ * process records the data still queued may use, then carries on from
+ * the first write the last one did not finish, so each one is a stream
+ * readers can decode on its own.  Bytes the kernel had accepted when a connection broke
+ * are lost, and a write that was cut off is sent again in full.
+ *
+ * A write that does not fit in the ring is dropped.  The stream then
+ * has a hole in it, so the connection is restarted at that point.
+ */
+
+/* Returns 0 once the ring and the thread are set up, -1 otherwise. */
+int spool_open(const char *path, size_t bytes, const char *node, const char *service);
+
+/* Experiment info, sent first on every connection. */
+int spool_header(const void *header, size_t bytes);
+
+/*
+ * The process record for id, resent after the header on every later
+ * connection until the id is retired.
+ */
+void spool_record(uint32_t id, const void *record, size_t bytes);
+
+/*
+ * id's retire record ends `at' bytes into the stream (counting all that
+ * spool_write is given).  Its record is still resent while data before
+ * that may be sent again.
+ */
+void spool_retire(uint32_t id, uint64_t at);
+
+/* Queue data.  Never waits; returns -1 only if the spool isn't open. */
+int spool_write(const void *data, size_t bytes);
+
+/*
+ * Give the thread up to timeout_ms to send what is queued, then shut
+ * everything down and print statistics to stderr.
+ */
+void spool_close(int timeout_ms);
+
+#endif
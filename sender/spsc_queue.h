@@ -0,0 +1,70 @@
+
+#ifndef ANDROID_ARM_PROJECT_SPSC_QUEUE_H
+#define ANDROID_ARM_PROJECT_SPSC_QUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded single-producer/single-consumer ring.
+ * Exactly one thread may push and exactly one (other) thread may pop;
+ * neither side ever takes a lock.  The capacity is rounded up to a power
+ * of two.  push() and pop() return false instead of waiting when the
+ * queue is full or empty, so the caller decides how to back off.
+ */
+template <typename T>
+class spsc_queue {
+	std::vector<T> slots;
+	size_t mask;
+
+	/* Kept on separate cache lines so the two sides do not fight. */
+	alignas(64) std::atomic<size_t> head;	/* Next slot to pop */
+	alignas(64) std::atomic<size_t> tail;	/* Next slot to push */
+
+public:
+	explicit spsc_queue(size_t capacity) : head(0), tail(0)
+	{
+		size_t n = 1;
+		while (n < capacity)
+			n <<= 1;
+		slots.resize(n);
+		mask = n - 1;
+	}
+
+	bool push(T item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask)
+			return false;
+		slots[t & mask] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(slots[h & mask]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Approximate when called from a third thread. */
+	size_t size() const
+	{
+		return tail.load(std::memory_order_acquire) -
+		       head.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+};
+
+#endif
@@ -0,0 +1,271 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "stats.h"
+
+/* Bucket b counts values in [2^(b-1), 2^b); bucket 0 counts zeros */
+#define HISTOGRAM_BUCKETS (64)
+
+/* How often the thread looks for SIGUSR1 and the interval */
+#define STATS_TICK_NS (200000000L)
+
+struct histogram {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+};
+
+struct gauge {
+	std::atomic<uint64_t> value;
+	std::atomic<uint64_t> max;
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+	"device_reads", "device_bytes", "samples", "kernel_missed", "dropped", "throttled", "packets",
+	"sends", "bytes", "proc_new", "proc_reads", "proc_requests"
+};
+
+static const char *gauge_names[STAT_GAUGES] = {
+	"raw_queue", "out_queue", "resolver_queue",
+	"spool_fill", "processes", "throttle_level"
+};
+
+static const char *histogram_names[STAT_HISTOGRAMS] = {
+	"read_ns", "encode_ns_per_sample", "send_ns", "proc_ns"
+};
+
+static struct {
+	std::atomic<uint64_t> counters[STAT_COUNTERS];
+	struct gauge gauges[STAT_GAUGES];
+	struct histogram histograms[STAT_HISTOGRAMS];
+
+	/* Everything below belongs to the stats thread */
+	std::thread *thread;
+	std::atomic<int> stop;
+	FILE *out;		/* Stats file, or NULL for stderr */
+	uint64_t interval_ns;
+	uint64_t started;
+	uint64_t last_dump;
+	uint64_t last[STAT_COUNTERS];	/* Counters at the last dump, for rates */
+} st;
+
+uint64_t stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(enum stats_counter c, uint64_t n)
+{
+	st.counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+static void raise_max(std::atomic<uint64_t> &max, uint64_t value)
+{
+	uint64_t seen = max.load(std::memory_order_relaxed);
+
+	while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed));
+}
+
+void stats_set(enum stats_gauge g, uint64_t value)
+{
+	st.gauges[g].value.store(value, std::memory_order_relaxed);
+	raise_max(st.gauges[g].max, value);
+}
+
+void stats_time(enum stats_histogram h, uint64_t ns)
+{
+	struct histogram *hg = &st.histograms[h];
+	unsigned b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (b >= HISTOGRAM_BUCKETS)
+		b = HISTOGRAM_BUCKETS - 1;
+	hg->buckets[b].fetch_add(1, std::memory_order_relaxed);
+	hg->count.fetch_add(1, std::memory_order_relaxed);
+	hg->sum.fetch_add(ns, std::memory_order_relaxed);
+	raise_max(hg->max, ns);
+}
+
+static void append(std::string &s, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(&buf[0], sizeof(buf), fmt, ap);
+	va_end(ap);
+	s += &buf[0];
+}
+
+/* Upper bound of the bucket holding the q'th quantile */
+static uint64_t quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t want = (uint64_t)(q * count);
+	uint64_t seen = 0;
+	unsigned b = 0;
+
+	for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		seen += buckets[b];
+		if (seen > want)
+			return b ? (1ULL << b) - 1 : 0;
+	}
+	return 0;
+}
+
+static void dump_histogram(std::string &s, struct histogram *hg)
+{
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count = 0;
+	unsigned b = 0;
+	int first = 1;
+
+	/* Not a consistent snapshot, but close enough for percentiles */
+	for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		buckets[b] = hg->buckets[b].load(std::memory_order_relaxed);
+		count += buckets[b];
+	}
+
+	append(s, "{\"count\":%llu,\"sum\":%llu,\"max\":%llu,"
+	    "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":{",
+	    (unsigned long long)(count),
+	    (unsigned long long)(hg->sum.load(std::memory_order_relaxed)),
+	    (unsigned long long)(hg->max.load(std::memory_order_relaxed)),
+	    (unsigned long long)(quantile(&buckets[0], count, 0.5)),
+	    (unsigned long long)(quantile(&buckets[0], count, 0.9)),
+	    (unsigned long long)(quantile(&buckets[0], count, 0.99)));
+	/* Keyed by each bucket's upper bound; empty buckets are left out */
+	for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		if (!buckets[b])
+			continue;
+		append(s, "%s\"%llu\":%llu", first ? "" : ",",
+		    (unsigned long long)(b ? (1ULL << b) - 1 : 0),
+		    (unsigned long long)(buckets[b]));
+		first = 0;
+	}
+	s += "}}";
+}
+
+static void dump(FILE *out)
+{
+	uint64_t now = stats_now();
+	double elapsed = (now - st.last_dump) / 1e9;
+	uint64_t counters[STAT_COUNTERS];
+	struct timespec wall;
+	std::string s;
+	int i = 0;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	for (i = 0; i < STAT_COUNTERS; ++i)
+		counters[i] = st.counters[i].load(std::memory_order_relaxed);
+
+	append(s, "{\"time\":%ld.%03ld,\"uptime\":%.3f,\"interval\":%.3f,\"counters\":{",
+	    (long)(wall.tv_sec), wall.tv_nsec / 1000000L,
+	    (now - st.started) / 1e9, elapsed);
+	for (i = 0; i < STAT_COUNTERS; ++i)
+		append(s, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+		    (unsigned long long)(counters[i]));
+
+	/* Per second since the last dump */
+	s += "},\"rates\":{";
+	for (i = 0; i < STAT_COUNTERS; ++i)
+		append(s, "%s\"%s\":%.1f", i ? "," : "", counter_names[i],
+		    elapsed > 0 ? (counters[i] - st.last[i]) / elapsed : 0.0);
+
+	s += "},\"gauges\":{";
+	for (i = 0; i < STAT_GAUGES; ++i)
+		append(s, "%s\"%s\":{\"value\":%llu,\"max\":%llu}", i ? "," : "", gauge_names[i],
+		    (unsigned long long)(st.gauges[i].value.load(std::memory_order_relaxed)),
+		    (unsigned long long)(st.gauges[i].max.load(std::memory_order_relaxed)));
+
+	s += "},\"histograms\":{";
+	for (i = 0; i < STAT_HISTOGRAMS; ++i) {
+		append(s, "%s\"%s\":", i ? "," : "", histogram_names[i]);
+		dump_histogram(s, &st.histograms[i]);
+	}
+	s += "}}\n";
+
+	if (fwrite(s.data(), 1, s.size(), out) != s.size() || fflush(out))
+		fprintf(stderr, "stats:  write failed:  %s\n", strerror(errno));
+
+	for (i = 0; i < STAT_COUNTERS; ++i)
+		st.last[i] = counters[i];
+	st.last_dump = now;
+}
+
+static void stats_main()
+{
+	struct timespec tick = {0, STATS_TICK_NS};
+	uint64_t next = st.interval_ns ? stats_now() + st.interval_ns : 0;
+	sigset_t usr1;
+
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+
+	while (!st.stop.load(std::memory_order_relaxed)) {
+		if (sigtimedwait(&usr1, NULL, &tick) == SIGUSR1)
+			dump(st.out ? st.out : stderr);
+		if (next && stats_now() >= next) {
+			dump(st.out ? st.out : stderr);
+			next += st.interval_ns;
+		}
+	}
+}
+
+int stats_start(const char *path, unsigned interval_s)
+{
+	sigset_t usr1;
+
+	if (st.thread)
+		return 0;
+
+	st.out = NULL;
+	if (path) {
+		st.out = fopen(path, "a");
+		if (!st.out) {
+			fprintf(stderr, "stats:  %s:  %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* Taken only by sigtimedwait() on the stats thread */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+	st.interval_ns = (uint64_t)(interval_s) * 1000000000ULL;
+	st.started = st.last_dump = stats_now();
+	memset(&st.last[0], 0, sizeof(st.last));
+	st.stop = 0;
+	st.thread = new std::thread(stats_main);
+	return 0;
+}
+
+void stats_stop()
+{
+	if (!st.thread)
+		return;
+
+	st.stop = 1;
+	st.thread->join();
+	delete st.thread;
+	st.thread = NULL;
+
+	if (st.out) {
+		dump(st.out);
+		fclose(st.out);
+		st.out = NULL;
+	}
+}
@@ -0,0 +1,70 @@
+
+#ifndef ANDROID_ARM_PROJECT_STATS_H
+#define ANDROID_ARM_PROJECT_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Sender self-instrumentation.  Counters, gauges and latency histograms
+ * are plain relaxed atomics, updated once per buffer, packet or /proc
+ * read rather than per sample, so they are always on.  Any thread may
+ * update any of them.
+ *
+ * A thread of its own dumps everything as one JSON object per line:
+ * appended to a stats file every interval, and whenever the sender gets
+ * SIGUSR1 (to stderr if there is no stats file).
+ */
+enum stats_counter {
+	STAT_DEVICE_READS,	/* Buffers read from the device */
+	STAT_DEVICE_BYTES,
+	STAT_SAMPLES,		/* Samples encoded */
+	STAT_KERNEL_MISSED,	/* Samples the module had no buffer for */
+	STAT_DROPPED,		/* Samples the sender had no room for */
+	STAT_THROTTLED,		/* Samples skipped or summed up by --rate */
+	STAT_PACKETS,		/* Sample packets encoded */
+	STAT_SENDS,		/* Writes to the socket, file or spool */
+	STAT_BYTES,		/* Bytes in those writes */
+	STAT_PROC_NEW,		/* Pids not in the process table */
+	STAT_PROC_READS,	/* /proc reads done inline by the encoder */
+	STAT_PROC_REQUESTS,	/* /proc reads handed to the resolver */
+	STAT_COUNTERS
+};
+
+enum stats_gauge {
+	STAT_RAW_QUEUE,		/* Buffers waiting for the encoder */
+	STAT_OUT_QUEUE,		/* Chunks waiting for the network */
+	STAT_RESOLVER_QUEUE,	/* Pids waiting for the resolver */
+	STAT_SPOOL_FILL,	/* Bytes in the spool ring */
+	STAT_PROCESSES,		/* Entries in the process table */
+	STAT_THROTTLE_LEVEL,	/* Degradation level under --rate */
+	STAT_GAUGES
+};
+
+enum stats_histogram {
+	STAT_READ_NS,		/* Device read, per buffer */
+	STAT_ENCODE_NS,		/* Encoding, per sample */
+	STAT_SEND_NS,		/* Per write */
+	STAT_PROC_NS,		/* Inline /proc read, per pid */
+	STAT_HISTOGRAMS
+};
+
+/* Monotonic nanoseconds, for timing things */
+uint64_t stats_now();
+
+void stats_add(enum stats_counter c, uint64_t n);
+void stats_set(enum stats_gauge g, uint64_t value);
+void stats_time(enum stats_histogram h, uint64_t ns);
+
+/*
+ * Start the dumping thread.  path may be NULL (SIGUSR1 then dumps to
+ * stderr) and an interval of 0 only dumps on SIGUSR1.  This blocks
+ * SIGUSR1 in the calling thread, so call it before starting any others;
+ * they inherit the mask and only the stats thread ever takes the
+ * signal.  Returns 0 on success, -1 on failure.
+ */
+int stats_start(const char *path, unsigned interval_s);
+
+/* Write a last dump (if there is a stats file) and stop the thread. */
+void stats_stop();
+
+#endif
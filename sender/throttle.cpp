@@ -0,0 +1,163 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "stats.h"
+#include "throttle.h"
+
+/* Deepest level of one kind of thinning:  1 sample in 1024 */
+#define THROTTLE_MAX_LEVEL (10)
+
+/* Least time between level changes */
+#define THROTTLE_SETTLE_NS (50000000ULL)
+
+static struct {
+	uint64_t rate;		/* Bytes per second, 0 when off */
+	enum throttle_policy policy;
+
+	int64_t tokens;		/* Bytes we may still send; negative is debt */
+	int64_t burst;		/* Bucket depth */
+	uint64_t refilled;	/* stats_now() of the last refill */
+	uint64_t changed;	/* ... and of the last level change */
+	unsigned level;
+
+	uint64_t ticks[2];	/* User and kernel samples seen, for every Nth */
+
+	size_t samples, buffers_dropped;
+	uint32_t dropped;
+	unsigned max_level;
+} th;
+
+int throttle_policy_by_name(const char *name, enum throttle_policy *policy)
+{
+	if (!strcmp(name, "nth"))
+		*policy = THROTTLE_NTH;
+	else if (!strcmp(name, "aggregate"))
+		*policy = THROTTLE_AGGREGATE;
+	else if (!strcmp(name, "kernel"))
+		*policy = THROTTLE_KERNEL;
+	else
+		return -1;
+	return 0;
+}
+
+void throttle_set(uint64_t bytes_per_sec, enum throttle_policy policy)
+{
+	memset(&th, 0, sizeof(th));
+	th.rate = bytes_per_sec;
+	th.policy = policy;
+	th.burst = th.tokens = (int64_t)(bytes_per_sec);
+	th.refilled = th.changed = stats_now();
+	if (bytes_per_sec && policy == THROTTLE_AGGREGATE)
+		aggregate_on_demand(THROTTLE_INTERVAL_MS);
+}
+
+int throttle_enabled()
+{
+	return th.rate != 0;
+}
+
+static unsigned top_level()
+{
+	switch (th.policy) {
+		case THROTTLE_AGGREGATE:
+			return 1;
+		case THROTTLE_KERNEL:
+			return 2 * THROTTLE_MAX_LEVEL;
+		default:
+			return THROTTLE_MAX_LEVEL;
+	}
+}
+
+int throttle_start(struct buffer &b)
+{
+	uint64_t now = stats_now();
+
+	th.tokens += (int64_t)((double)(th.rate) * (now - th.refilled) / 1e9);
+	if (th.tokens > th.burst)
+		th.tokens = th.burst;
+	th.refilled = now;
+
+	th.samples += b.num_samples;
+	if (th.tokens < -th.burst) {
+		th.dropped += b.num_samples;
+		++th.buffers_dropped;
+		stats_add(STAT_DROPPED, b.num_samples);
+		return -1;
+	}
+
+	if (now - th.changed >= THROTTLE_SETTLE_NS) {
+		if (th.tokens < 0 && th.level < top_level()) {
+			++th.level;
+			th.changed = now;
+		} else if (th.tokens > th.burst / 2 && th.level) {
+			--th.level;
+			th.changed = now;
+		}
+		if (th.level > th.max_level)
+			th.max_level = th.level;
+		stats_set(STAT_THROTTLE_LEVEL, th.level);
+	}
+	if (throttle_folding())
+		stats_add(STAT_THROTTLED, b.num_samples);
+	return 0;
+}
+
+int throttle_folding()
+{
+	return th.policy == THROTTLE_AGGREGATE && th.level;
+}
+
+/* One in 2^level of each kind of sample, evenly spaced */
+static struct sample *every_nth(struct sample &s, unsigned level, int kernel, uint32_t *weight)
+{
+	uint64_t mask = (1ULL << level) - 1;
+
+	if (th.ticks[kernel]++ & mask) {
+		stats_add(STAT_THROTTLED, 1);
+		return NULL;
+	}
+	*weight = 1U << level;
+	return &s;
+}
+
+struct sample *throttle_sample(struct sample &s, struct ProcessInfo &pi, uint32_t *weight)
+{
+	int kernel = (pi.mode == ProcessInfo::Kernel);
+
+	*weight = 1;
+	if (!th.level)
+		return &s;
+
+	switch (th.policy) {
+		case THROTTLE_AGGREGATE:
+			/* Folded whole instead; see throttle_folding */
+			return &s;
+		case THROTTLE_KERNEL:
+			if (kernel)
+				return every_nth(s, th.level < THROTTLE_MAX_LEVEL ?
+				    th.level : THROTTLE_MAX_LEVEL, 1, weight);
+			return every_nth(s, th.level > THROTTLE_MAX_LEVEL ?
+			    th.level - THROTTLE_MAX_LEVEL : 0, 0, weight);
+		default:
+			return every_nth(s, th.level, kernel, weight);
+	}
+}
+
+void throttle_spent(size_t bytes)
+{
+	th.tokens -= (int64_t)(bytes);
+}
+
+void throttle_report()
+{
+	static const char *names[] = { "nth", "aggregate", "kernel" };
+
+	if (!th.rate)
+		return;
+	fprintf(stderr, "Rate limit:  %llu bytes/s (%s), level %u now, %u at most, "
+	    "%zu of %zu samples in %zu buffers dropped\n",
+	    (unsigned long long)(th.rate), names[th.policy], th.level, th.max_level,
+	    (size_t)(th.dropped), th.samples, th.buffers_dropped);
+}
@@ -0,0 +1,73 @@
+
+#ifndef ANDROID_ARM_PROJECT_THROTTLE_H
+#define ANDROID_ARM_PROJECT_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "process_info.h"
+#include "sample_buffer.h"
+
+/*
+ * Bandwidth cap for the encoder.  A token bucket (one second of the
+ * rate deep) is charged with every byte encoded:  the encoder is where
+ * what to send is decided, and whatever it encodes is sent, so
+ * charging the sends themselves would only find out later.  When the
+ * bucket runs dry the encoder degrades by a level, and when it is half
+ * full again it backs off a level; levels only move every so often, so
+ * each change gets to show before the next.  If the debt still reaches
+ * a full bucket whole buffers are dropped and counted as missed, so the
+ * cap holds whatever the load.
+ *
+ * The policies, at level L:
+ *
+ *   nth       -- keep every 2^L'th sample, with weight 2^L
+ *   aggregate -- one level:  buffers go into per pid and core sums,
+ *                sent as aggregate records (see aggregate.h) every
+ *                THROTTLE_INTERVAL_MS, instead of as packets
+ *   kernel    -- thin kernel-mode samples first (1 in 2^L); only past
+ *                the last kernel level are user samples thinned too
+ *
+ * A sample of weight w stands for w samples, so sums over w * value
+ * stay unbiased.  The weights travel in WEIGHTED packets; aggregate
+ * records hold exact sums.
+ */
+
+/* Length of the aggregate policy's intervals */
+#define THROTTLE_INTERVAL_MS (1000)
+
+enum throttle_policy {
+	THROTTLE_NTH,
+	THROTTLE_AGGREGATE,
+	THROTTLE_KERNEL
+};
+
+/* Returns 0 and sets *policy, or -1 for an unknown name. */
+int throttle_policy_by_name(const char *name, enum throttle_policy *policy);
+
+/* Cap the encoder at bytes_per_sec (0 turns the cap off). */
+void throttle_set(uint64_t bytes_per_sec, enum throttle_policy policy);
+int throttle_enabled();
+
+/*
+ * Refill the bucket and pick the level for buffer b.  Returns 0 if it
+ * may be encoded, -1 if it has to be dropped.
+ */
+int throttle_start(struct buffer &b);
+
+/*
+ * Whether the buffer throttle_start passed goes into the aggregate
+ * interval's sums instead of packets.
+ */
+int throttle_folding();
+
+/* The sample to encode in place of s and its weight, or NULL to skip s. */
+struct sample *throttle_sample(struct sample &s, struct ProcessInfo &pi, uint32_t *weight);
+
+/* Charge the bucket for bytes encoded. */
+void throttle_spent(size_t bytes);
+
+/* Print statistics to stderr. */
+void throttle_report();
+
+#endif
@@ -0,0 +1,556 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <deque>
+#include <vector>
+
+#include "network.h"
+#include "stats.h"
+#include "uring.h"
+
+#define URING_MAX_READS (16)
+#define URING_MAX_CHUNKS (16)
+#define URING_MAX_WRITES (8)	/* Socket writes linked into one chain */
+
+#define KIND_READ (1ULL)
+#define KIND_WRITE (2ULL)
+
+enum { SLOT_IDLE, SLOT_PENDING, SLOT_DONE };
+
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned to_submit;
+};
+
+struct read_slot {
+	struct buffer *b;
+	int state;
+	int res;
+	uint64_t issued;	/* stats_now() at submission */
+};
+
+struct chunk {
+	char *data;
+	size_t len;
+};
+
+static struct {
+	const struct pipeline_config *config;
+	struct ring r;
+	int fixed;		/* Buffers are registered with the ring */
+
+	int dev_fd;
+	int out_fd;
+	off_t dev_off;		/* -1 for a character device */
+
+	std::vector<struct read_slot> reads;
+	unsigned read_head;	/* Next slot to hand to the encoder */
+	unsigned reads_in_flight;
+
+	std::vector<struct chunk> chunks;
+	std::vector<int> free_chunks;
+	std::deque<int> write_queue;	/* FIFO of full chunks */
+	size_t written;		/* Bytes of the first one already on the wire */
+
+	/* The chain of writes in flight:  its chunks in order, and results */
+	int flight[URING_MAX_WRITES];
+	int results[URING_MAX_WRITES];
+	unsigned nflight;
+	unsigned landed;	/* Completions of the chain so far */
+	uint64_t write_issued;
+	int current;		/* Chunk being filled, or -1 */
+
+	int failed;
+	int stop;
+	size_t dropped;
+	uint32_t unsent[256];	/* Samples dropped per core, not yet passed on */
+	size_t outbytes;
+	size_t syscalls;
+} u;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return (int)(syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0));
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return (int)(syscall(__NR_io_uring_register, fd, op, arg, n));
+}
+
+static void ring_close(struct ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+static int ring_open(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq = NULL;
+	char *cq = NULL;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_setup(entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)(mmap(NULL, r->sqes_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES));
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	sq = (char *)(r->sq_ptr);
+	cq = (char *)(r->cq_ptr);
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	ring_close(r);
+	return -1;
+}
+
+static struct io_uring_sqe *ring_sqe(struct ring *r)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	/* The ring is sized for everything we ever keep in flight. */
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->to_submit;
+	return sqe;
+}
+
+int uring_supported()
+{
+	struct ring r;
+
+	if (ring_open(&r, 2))
+		return 0;
+	ring_close(&r);
+	return 1;
+}
+
+static void submit_read(unsigned slot)
+{
+	struct io_uring_sqe *sqe = ring_sqe(&u.r);
+
+	sqe->opcode = u.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = u.dev_fd;
+	sqe->addr = (unsigned long)(u.reads[slot].b);
+	sqe->len = sizeof(struct buffer);
+	sqe->off = (u.dev_off < 0) ? (__u64)(-1) : (__u64)(u.dev_off);
+	sqe->buf_index = slot;
+	sqe->user_data = (KIND_READ << 32) | slot;
+	if (u.dev_off >= 0)
+		u.dev_off += sizeof(struct buffer);
+
+	u.reads[slot].state = SLOT_PENDING;
+	u.reads[slot].issued = stats_now();
+	++u.reads_in_flight;
+}
+
+static int writes_pending()
+{
+	return u.nflight || !u.write_queue.empty();
+}
+
+/*
+ * Streams must stay ordered.  The queued chunks go out as one chain of
+ * linked writes, which the kernel runs in order; a short or failed write
+ * cancels the rest of the chain.  Chains are not ordered among
+ * themselves, so the next one waits for all of this one.
+ */
+static void start_write()
+{
+	unsigned i = 0;
+
+	if (u.nflight || u.write_queue.empty())
+		return;
+
+	while (u.nflight < URING_MAX_WRITES && !u.write_queue.empty()) {
+		u.flight[u.nflight++] = u.write_queue.front();
+		u.write_queue.pop_front();
+	}
+	u.landed = 0;
+	u.write_issued = stats_now();
+
+	for (i = 0; i < u.nflight; ++i) {
+		struct io_uring_sqe *sqe = ring_sqe(&u.r);
+		struct chunk *c = &u.chunks[u.flight[i]];
+		size_t skip = i ? 0 : u.written;
+
+		sqe->opcode = u.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = u.out_fd;
+		sqe->addr = (unsigned long)(c->data + skip);
+		sqe->len = c->len - skip;
+		sqe->off = (__u64)(-1);
+		sqe->buf_index = u.reads.size() + u.flight[i];
+		sqe->user_data = (KIND_WRITE << 32) | i;
+		if (i + 1 < u.nflight)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+}
+
+/* Settle a chain once all of it has landed; what didn't go out is requeued. */
+static void finish_chain()
+{
+	const struct pipeline_config *config = u.config;
+	unsigned i = 0;
+	unsigned n = u.nflight;
+
+	for (i = 0; i < n; ++i) {
+		struct chunk *c = &u.chunks[u.flight[i]];
+		int res = u.results[i];
+
+		if (res > 0) {
+			u.written += res;
+			u.outbytes += res;
+			stats_add(STAT_SENDS, 1);
+			stats_add(STAT_BYTES, res);
+		}
+		if (res > 0 && u.written == c->len) {
+			u.free_chunks.push_back(u.flight[i]);
+			u.written = 0;
+			continue;
+		}
+		/* Short, interrupted, or cancelled by an earlier link:  again */
+		if (res > 0 || res == -EINTR || res == -EAGAIN || res == -ECANCELED)
+			break;
+
+		fprintf(stderr, "error:  Could not send chunk:  %s\n",
+		    res ? strerror(-res) : "connection closed");
+		u.failed = 1;
+		u.stop = 1;
+		for (; i < n; ++i)
+			u.free_chunks.push_back(u.flight[i]);
+		u.write_queue.clear();
+		break;
+	}
+	for (; n > i; --n)
+		u.write_queue.push_front(u.flight[n - 1]);
+	u.nflight = 0;
+	stats_time(STAT_SEND_NS, stats_now() - u.write_issued);
+
+	if (config->kbytes > 0 && u.outbytes / 1000 > config->kbytes && !u.stop) {
+		fprintf(stderr, "%zu kb requested, %zu bytes sent.\n",
+		    config->kbytes, u.outbytes);
+		u.stop = 1;
+	}
+}
+
+static void finish_write(unsigned index, int res)
+{
+	u.results[index] = res;
+	if (++u.landed == u.nflight)
+		finish_chain();
+}
+
+/* Submit whatever is queued and reap completions, waiting for at least `wait'. */
+static int ring_cycle(unsigned wait)
+{
+	struct ring *r = &u.r;
+	unsigned head = 0;
+	int rc = 0;
+
+	if (r->to_submit || wait) {
+		rc = sys_enter(r->fd, r->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		++u.syscalls;
+		if (rc < 0 && errno != EINTR && errno != EBUSY) {
+			fprintf(stderr, "io_uring_enter error:  %s\n", strerror(errno));
+			return -1;
+		}
+		if (rc >= 0)
+			r->to_submit -= (unsigned)(rc) < r->to_submit ? rc : r->to_submit;
+	}
+
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		unsigned kind = (unsigned)(cqe->user_data >> 32);
+		unsigned index = (unsigned)(cqe->user_data & 0xffffffffU);
+
+		if (kind == KIND_READ) {
+			if (cqe->res > 0)
+				stats_time(STAT_READ_NS, stats_now() - u.reads[index].issued);
+			u.reads[index].res = cqe->res;
+			u.reads[index].state = SLOT_DONE;
+			--u.reads_in_flight;
+		} else {
+			finish_write(index, cqe->res);
+		}
+		++head;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void queue_current()
+{
+	if (u.current < 0)
+		return;
+	if (!u.chunks[u.current].len) {
+		u.free_chunks.push_back(u.current);
+	} else {
+		u.write_queue.push_back(u.current);
+		start_write();
+	}
+	u.current = -1;
+}
+
+static int uring_sink(void *packet, size_t bytes, size_t *sent, void *arg)
+{
+	const struct pipeline_config *config = u.config;
+	struct chunk *c = NULL;
+
+	(void)(arg);
+	if (bytes > config->chunk_size) {
+		/* Too big for any registered chunk: push it out by hand. */
+		queue_current();
+		while (writes_pending()) {
+			if (ring_cycle(1) || u.failed)
+				return -1;
+			start_write();
+		}
+		return network_packet(packet, bytes, sent);
+	}
+
+	if (u.current >= 0 && config->chunk_size - u.chunks[u.current].len < bytes)
+		queue_current();
+
+	while (u.current < 0) {
+		if (!u.free_chunks.empty()) {
+			u.current = u.free_chunks.back();
+			u.free_chunks.pop_back();
+			u.chunks[u.current].len = 0;
+			break;
+		}
+		/* Every chunk is queued; wait on the wire. */
+		if (ring_cycle(1) || u.failed)
+			return -1;
+		start_write();
+	}
+
+	c = &u.chunks[u.current];
+	memcpy(c->data + c->len, packet, bytes);
+	c->len += bytes;
+	if (sent)
+		*sent = bytes;
+	return 0;
+}
+
+/* Hand completed reads to the encoder in the order they were issued. */
+static void drain_reads(int *eof)
+{
+	const struct pipeline_config *config = u.config;
+
+	while (u.reads[u.read_head].state == SLOT_DONE) {
+		struct read_slot *slot = &u.reads[u.read_head];
+
+		if (slot->res != (int)(sizeof(struct buffer))) {
+			if (slot->res < 0)
+				fprintf(stderr, "Device read error:  %s\n", strerror(-slot->res));
+			*eof = 1;
+		} else if (!u.stop) {
+			stats_add(STAT_DEVICE_READS, 1);
+			stats_add(STAT_DEVICE_BYTES, sizeof(struct buffer));
+			stats_add(STAT_KERNEL_MISSED, slot->b->missed);
+
+			/*
+			 * Nowhere to put more packets: drop this buffer instead
+			 * of letting the device back up.
+			 */
+			uint32_t *unsent = &u.unsent[(uint8_t)(slot->b->core)];
+
+			if (u.free_chunks.empty() && u.current < 0) {
+				u.dropped += slot->b->num_samples;
+				*unsent += slot->b->num_samples + slot->b->missed;
+				stats_add(STAT_DROPPED, slot->b->num_samples);
+			} else {
+				uint32_t dropped = *unsent;
+
+				*unsent = 0;
+				if (network_encode(*slot->b, dropped, uring_sink, NULL, NULL))
+					u.stop = 1;
+				else if (config->inspect)
+					config->inspect(*slot->b);
+			}
+		}
+
+		slot->state = SLOT_IDLE;
+		if (!*eof && !u.stop)
+			submit_read(u.read_head);
+		u.read_head = (u.read_head + 1) % u.reads.size();
+	}
+}
+
+int uring_run(FILE *device, const struct pipeline_config *config)
+{
+	std::vector<struct iovec> iov;
+	std::vector<struct buffer> buffers;
+	struct stat st;
+	size_t nreads = config->buffers < URING_MAX_READS ? config->buffers : URING_MAX_READS;
+	size_t nchunks = config->chunks < URING_MAX_CHUNKS ? config->chunks : URING_MAX_CHUNKS;
+	size_t i = 0;
+	int eof = 0;
+
+	if (!nreads)
+		nreads = 1;
+	if (!nchunks)
+		nchunks = 1;
+
+	u.config = config;
+	u.dev_fd = fileno(device);
+	u.out_fd = network_fd();
+	u.dev_off = -1;
+	if (!fstat(u.dev_fd, &st) && S_ISREG(st.st_mode))
+		u.dev_off = ftell(device);	/* Not lseek:  stdio may have read ahead */
+	u.read_head = 0;
+	u.reads_in_flight = 0;
+	u.write_queue.clear();
+	u.written = 0;
+	u.nflight = 0;
+	u.landed = 0;
+	u.free_chunks.clear();
+	u.current = -1;
+	u.failed = 0;
+	u.stop = 0;
+	u.dropped = 0;
+	memset(&u.unsent[0], 0, sizeof(u.unsent));
+	u.outbytes = 0;
+	u.syscalls = 0;
+
+	/* Reads + a chain of writes, with room to spare for resubmissions. */
+	if (ring_open(&u.r, (unsigned)(nreads + URING_MAX_WRITES + 1))) {
+		fprintf(stderr, "io_uring setup error:  %s\n", strerror(errno));
+		return -1;
+	}
+
+	buffers.resize(nreads);
+	u.reads.resize(nreads);
+	for (i = 0; i < nreads; ++i) {
+		struct iovec v = { &buffers[i], sizeof(struct buffer) };
+		u.reads[i].b = &buffers[i];
+		u.reads[i].state = SLOT_IDLE;
+		iov.push_back(v);
+	}
+	u.chunks.resize(nchunks);
+	for (i = 0; i < nchunks; ++i) {
+		struct iovec v;
+		u.chunks[i].data = (char *)(malloc(config->chunk_size));
+		u.chunks[i].len = 0;
+		if (!u.chunks[i].data) {
+			fprintf(stderr, "Could not allocate io_uring chunks.\n");
+			u.failed = 1;
+			goto out;
+		}
+		v.iov_base = u.chunks[i].data;
+		v.iov_len = config->chunk_size;
+		iov.push_back(v);
+		u.free_chunks.push_back(i);
+	}
+
+	/* Pinning can fail under a low RLIMIT_MEMLOCK; plain reads still work. */
+	u.fixed = !sys_register(u.r.fd, IORING_REGISTER_BUFFERS, &iov[0], iov.size());
+
+	for (i = 0; i < nreads; ++i)
+		submit_read(i);
+
+	while (u.reads_in_flight || writes_pending() || u.current >= 0) {
+		if (ring_cycle(1))
+			break;
+		drain_reads(&eof);
+		if (u.failed)
+			break;
+
+		/* The wire is idle: don't sit on a partial chunk. */
+		if (!writes_pending())
+			queue_current();
+		start_write();
+	}
+
+	/* Wait out anything the kernel still holds before freeing it. */
+	while (u.reads_in_flight || u.nflight) {
+		if (ring_cycle(1))
+			break;
+	}
+
+	fprintf(stderr, "io_uring statistics:\n");
+	fprintf(stderr, "  %zu io_uring_enter calls (%s buffers), %zu samples dropped, %zu bytes sent\n",
+	    u.syscalls, u.fixed ? "registered" : "unregistered", u.dropped, u.outbytes);
+
+out:
+	ring_close(&u.r);
+	for (i = 0; i < u.chunks.size(); ++i)
+		free(u.chunks[i].data);
+	u.chunks.clear();
+	u.reads.clear();
+	return u.failed ? -1 : 0;
+}
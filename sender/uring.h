@@ -0,0 +1,29 @@
+
+#ifndef ANDROID_ARM_PROJECT_URING_H
+#define ANDROID_ARM_PROJECT_URING_H
+
+#include <stdio.h>
+
+#include "pipeline.h"
+
+/*
+ * Single-threaded io_uring engine.  Several device reads and a linked
+ * chain of socket writes are kept in flight at once out of registered
+ * buffers, and the thread only enters the kernel once per round of
+ * completions.  Packets are encoded between completions, so one core is
+ * enough to keep up with the device.
+ *
+ * The same pipeline_config is honoured, except that the number of reads
+ * in flight is capped by the ring size.
+ */
+
+/* Return whether io_uring can be set up here (kernel and seccomp allowing). */
+int uring_supported();
+
+/*
+ * Run until end of file, the kbytes limit or a write error.
+ * Returns 0 on a clean finish and -1 on error.
+ */
+int uring_run(FILE *device, const struct pipeline_config *config);
+
+#endif
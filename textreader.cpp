@@ -1,13 +1,15 @@
 #include "module/sample_buffer.h"
+#include "sender/flat_table.h"
+#include "sender/csv_writer.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <cassert>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <fstream>
 #include <streambuf>
-#include <unordered_map>
 #include <string>
 
 using namespace std;
@@ -19,16 +21,22 @@ struct ProcessInfo {
 		Kernel,
 		User
 	} mode;
-	string cmdline;
-	string executable;
+	// The end of each of its lines, ",cmdline,exe\n", put together once
+	const char* tail;
+	size_t tailLength;
 
 	ProcessInfo() {
 		pid = 0;
 		mode = Unknown;
+		tail = ",,\n";
+		tailLength = 3;
 	}
 };
 
-unordered_map<unsigned long, ProcessInfo> procMap;
+// Bounded, so a long run over a busy machine doesn't grow forever
+flat_table<ProcessInfo> procMap(16384);
+string_arena strings;
+csv_writer output(STDOUT_FILENO);
 
 void readInto(unsigned long pid, const char* fn, string& into) {
 	char fnBuffer[256];
@@ -51,14 +59,35 @@ void readLinkPathInto(unsigned long pid, const char* fn, string& into) {
 }
 
 void populate(ProcessInfo& pi) {
-	readInto(pi.pid, "cmdline", pi.cmdline);
-	readLinkPathInto(pi.pid, "exe", pi.executable);
-	if (pi.executable == "" && pi.cmdline == "")
+	string cmdline, executable;
+	readInto(pi.pid, "cmdline", cmdline);
+	readLinkPathInto(pi.pid, "exe", executable);
+	string tail = "," + string(cmdline.c_str()) + "," + executable + "\n";
+	pi.tail = strings.store(tail.c_str());
+	pi.tailLength = strlen(pi.tail);
+	if (pi.tailLength == 3)
 		pi.mode = ProcessInfo::Kernel;
 	else
 		pi.mode = ProcessInfo::User;
 }
 
+void forget(uint32_t pid, ProcessInfo& pi) {
+	(void)(pid);
+	strings.release(pi.tail);
+}
+
+// Between buffers nothing holds on to entries, so evict and compact here
+void trimProcesses() {
+	procMap.trim(forget);
+	if (strings.fragmented()) {
+		string_arena fresh;
+		procMap.for_each([&fresh](uint32_t, ProcessInfo& pi) {
+			pi.tail = fresh.store(pi.tail);
+		});
+		strings.swap(fresh);
+	}
+}
+
 ProcessInfo& getProcessInfo(unsigned long pid) {
 	ProcessInfo& pi = procMap[pid];
 	if (pi.mode == ProcessInfo::Unknown) {
@@ -70,15 +99,24 @@ ProcessInfo& getProcessInfo(unsigned long pid) {
 
 void outputBuffer(struct buffer& b) {
 	assert(b.num_samples <= BUFFER_ENTRIES);
+	trimProcesses();
 	for (size_t i=0; i<b.num_samples; i++) {
 		struct sample& c = b.samples[i];
 		ProcessInfo& pi = getProcessInfo(c.pid);
-		printf("%lu,%u,%lu,%u,%u,%u,%u,%u,%u,%s,%s\n", 
-			c.pid, b.core, c.cycles,
-			c.counters[0], c.counters[1], c.counters[2], 
-			c.counters[3], c.counters[4], c.counters[5],
-			pi.cmdline.c_str(), pi.executable.c_str());
-	}	
+		char* p = output.reserve(2 * CSV_MAX_U64 + 7 * (CSV_MAX_U32 + 1) + 1 +
+								 pi.tailLength);
+		p = csv_u64(p, c.pid);
+		*p++ = ',';
+		p = csv_u32(p, b.core);
+		*p++ = ',';
+		p = csv_u64(p, c.cycles);
+		for (size_t j=0; j<6; j++) {
+			*p++ = ',';
+			p = csv_u32(p, c.counters[j]);
+		}
+		output.commit(csv_text(p, pi.tail, pi.tailLength));
+	}
+	output.flush();
 }
 
 int main(int argc, const char** argv) {